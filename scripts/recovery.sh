@@ -0,0 +1,10 @@
+#!/usr/bin/env bash
+
+set -xe
+
+build/main recovery 15000 30
+python3 test.py > /dev/null
+build/main recovery 4000 0 pio
+python3 test.py > /dev/null
+build/main recovery 60000 100
+python3 test.py > /dev/null
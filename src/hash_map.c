@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common.h"
 #include "hash_map.h"
@@ -9,307 +14,2307 @@
 #include "murmur/murmur3.h"
 
 #define SENTINEL_END 1
+#define NIL_BUCKET   UINT32_MAX
+
+#define DEFAULT_PROMOTE_THRESHOLD 8
+#define DEFAULT_RAISE_PERIOD 8
+
+// Entries are addressed in 8 byte units from the start of the chunk's data,
+// and tags are compared TAG_GROUP at a time
+#define ENTRY_MAX (8 << 16)
+#define TAG_GROUP 16
+
+// Foreground operations take over eviction and demotion from the maintenance
+// worker once over budget by more than 1 / 2^MAINT_SLACK_SHIFT
+#define MAINT_SLACK_SHIFT 3
+#define COMPACT_BATCH 64
+
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE 10
+
+// The RAM controller steps at most every CONTROL_PERIOD_NS, checking the time
+// every CONTROL_OPS operations when there is no maintenance worker. Cuts take
+// 1 / 2^CONTROL_CUT_SHIFT of the budget, other steps 1 / 2^CONTROL_STEP_SHIFT.
+#define CONTROL_PERIOD_NS 100000000ULL
+#define CONTROL_OPS 1024
+#define CONTROL_CUT_SHIFT 3
+#define CONTROL_STEP_SHIFT 4
+
+#define MANIFEST_MAGIC 0x3250414d48534148ULL
+
+// Saved by hash_map_checkpoint after the table's bucket pointers and heat
+typedef struct {
+    u64 magic;
+    u64 chunk_size;
+    u32 cap;
+    u32 base_cap;
+    u32 level;
+    u32 split;
+    u32 size;
+    u32 max_load;
+    u8 promote_threshold;
+    u64 wal_lsn;
+} HashMapManifest;
+
+static u32 key_to_entry_size(u32 key_size) {
+    return key_size + sizeof(Entry) + 1;
+}
+
+// As many slots as entries with empty keys could fill the chunk, kept even so
+// that the offsets are aligned
+static u16 bucket_slots(u64 chunk_size) {
+    u64 slot_size = align_u64(key_to_entry_size(0)) + 3;
+    u64 slots = (chunk_size - offsetof(Bucket, tags)) / slot_size & ~1ULL;
+    return slots < 2 ? 2 : slots;
+}
+
+static u64 header_size(u16 slots) {
+    return align_u64(offsetof(Bucket, tags) + 3 * (u64) slots);
+}
+
+static u64 bucket_data_offset(u64 chunk_size) {
+    return header_size(bucket_slots(chunk_size));
+}
 
 void hash_map_init(
     HashMap *map, TieredAllocator *ta, u32 cap, u32 ram_buckets
 ) {
-    ASSERT(ta->chunk_size > 2 * sizeof(Entry) + sizeof(Bucket));
+    u64 data_offset = bucket_data_offset(ta->chunk_size);
+    ASSERT(ta->chunk_size > 2 * sizeof(Entry) + data_offset);
+    ASSERT(ta->chunk_size - data_offset <= ENTRY_MAX);
 
     map->ta = ta;
     map->in_ram = 0;
     map->ram_buckets = ram_buckets;
+    map->ram_low = ram_buckets;
+    map->hand = NIL_BUCKET;
+    map->cold_hits = 0;
+    map->promote_threshold = DEFAULT_PROMOTE_THRESHOLD;
+    map->raise_period = DEFAULT_RAISE_PERIOD;
+    map->raises = 0;
     map->cap = cap;
+    map->alloc = cap;
+    map->base_cap = cap;
+    map->level = 0;
+    map->split = 0;
+    map->max_load = 0;
     map->size = 0;
     map->buckets = malloc(cap * sizeof(*map->buckets));
     map->visits = calloc(cap, sizeof(*map->visits));
+    map->heat = calloc(cap, sizeof(*map->heat));
+    map->deep_hits = calloc(cap, sizeof(*map->deep_hits));
+    map->deep_tags = calloc(cap, sizeof(*map->deep_tags));
+    map->newer = malloc(cap * sizeof(*map->newer));
+    map->older = malloc(cap * sizeof(*map->older));
+    map->ram_queue.head = NIL_BUCKET;
+    map->ram_queue.tail = NIL_BUCKET;
+    map->cxl_queue.head = NIL_BUCKET;
+    map->cxl_queue.tail = NIL_BUCKET;
+    map->cxl_budget = UINT64_MAX;
+    map->concurrent = false;
+    map->latch_mask = 0;
+    map->latches = NULL;
+    map->maintenance = false;
+    map->compact_cursor = 0;
+    map->merges = 0;
+    map->evictions = 0;
+    map->demotions = 0;
+    map->promotions = 0;
+    map->ops = aligned_alloc(64, sizeof(*map->ops));
+    memset(map->ops, 0, sizeof(*map->ops));
+    map->wal = NULL;
+    map->wal_lsn = 0;
+    map->pinned = NULL;
+    map->retired = NULL;
+    map->num_retired = 0;
+    map->retired_cap = 0;
+    memset(&map->front, 0, sizeof(map->front));
+    memset(&map->sketch, 0, sizeof(map->sketch));
+    memset(&map->control, 0, sizeof(map->control));
+
+    ASSERT(map->buckets);
+    ASSERT(map->visits);
+    ASSERT(map->heat);
+    ASSERT(map->deep_hits);
+    ASSERT(map->deep_tags);
+    ASSERT(map->newer);
+    ASSERT(map->older);
+    ASSERT(map->ops);
+
+    for (u32 i = 0; i < cap; ++i)
+        map->buckets[i] = null_ptr();
+}
+
+// Share of ram_buckets kept as ram_low when the controller moves them, in
+// 1 / 2^16 units
+static void control_share(HashMap *map) {
+    map->control.low_share =
+        map->ram_buckets ? ((u64) map->ram_low << 16) / map->ram_buckets
+                         : 1u << 16;
+}
+
+void hash_map_set_low_watermark(HashMap *map, u32 ram_low) {
+    ASSERT(ram_low <= map->ram_buckets);
+    map->ram_low = ram_low;
+    control_share(map);
+}
+
+void hash_map_set_promotion(HashMap *map, u8 threshold) {
+    map->promote_threshold = threshold;
+}
+
+void hash_map_set_raise_period(HashMap *map, u8 period) {
+    map->raise_period = period;
+}
+
+void hash_map_set_cxl_budget(HashMap *map, u64 bytes) {
+    map->cxl_budget = bytes;
+}
+
+void hash_map_set_max_load(HashMap *map, u32 max_load) {
+    map->max_load = max_load;
+}
+
+void hash_map_set_ram_target(HashMap *map, u64 max_bytes, u32 latency_ns) {
+    ASSERT(max_bytes != 0 || latency_ns != 0);
+    RamControl *control = &map->control;
+    control->max_bytes = max_bytes;
+    control->latency_ns = latency_ns;
+    control->enabled = max_bytes != 0 || latency_ns != 0 ||
+                       control->pressure_limit != 0;
+    control_share(map);
+}
+
+void hash_map_set_pressure_limit(HashMap *map, u32 limit) {
+    RamControl *control = &map->control;
+    control->pressure_limit = limit;
+    control->enabled = control->max_bytes != 0 ||
+                       control->latency_ns != 0 || limit != 0;
+    control_share(map);
+}
+
+void hash_map_set_concurrent(HashMap *map, u32 stripes) {
+    ASSERT(stripes > 0 && (stripes & (stripes - 1)) == 0);
+    ASSERT(!map->concurrent);
+
+    map->latches = malloc(stripes * sizeof(*map->latches));
+    ASSERT(map->latches);
+
+    // The counters so far stay with the first stripe
+    OpCounters *ops = aligned_alloc(64, stripes * sizeof(*ops));
+    ASSERT(ops);
+    memset(ops, 0, stripes * sizeof(*ops));
+    ops[0] = map->ops[0];
+    free(map->ops);
+    map->ops = ops;
+
+    for (u32 k = 0; k < stripes; ++k)
+        ASSERT(pthread_mutex_init(map->latches + k, NULL) == 0);
+
+    ASSERT(pthread_mutex_init(&map->policy_lock, NULL) == 0);
+    ASSERT(pthread_mutex_init(&map->retire_lock, NULL) == 0);
+    ASSERT(pthread_rwlock_init(&map->table_lock, NULL) == 0);
+    map->latch_mask = stripes - 1;
+    map->concurrent = true;
+}
+
+static void front_free(FrontCache *front) {
+    u32 num_sets = front->sets ? 1u << front->set_bits : 0;
+    for (u32 set = 0; set < num_sets; ++set)
+        pthread_mutex_destroy(front->locks + set);
+
+    free(front->sets);
+    free(front->locks);
+    front->sets = NULL;
+}
+
+void hash_map_set_front_cache(HashMap *map, u32 entries) {
+    FrontCache *front = &map->front;
+    front_free(front);
+    if (entries == 0)
+        return;
+
+    front->set_bits = 0;
+    while (((u64) FRONT_WAYS << front->set_bits) < entries)
+        front->set_bits += 1;
+
+    u32 num_sets = 1u << front->set_bits;
+    front->sets = calloc(num_sets, sizeof(*front->sets));
+    front->locks = malloc(num_sets * sizeof(*front->locks));
+    ASSERT(front->sets);
+    ASSERT(front->locks);
+
+    for (u32 set = 0; set < num_sets; ++set)
+        ASSERT(pthread_mutex_init(front->locks + set, NULL) == 0);
+}
+
+void hash_map_set_admission(HashMap *map, u32 width) {
+    FreqSketch *sketch = &map->sketch;
+    free(sketch->counters);
+    memset(sketch, 0, sizeof(*sketch));
+    if (width == 0)
+        return;
+
+    while ((1u << sketch->width_bits) < width)
+        sketch->width_bits += 1;
+
+    sketch->counters = calloc(SKETCH_DEPTH, 1u << sketch->width_bits);
+    ASSERT(sketch->counters);
+}
+
+static void hash_map_free(HashMap *map) {
+    front_free(&map->front);
+    free(map->sketch.counters);
+
+    if (map->wal) {
+        wal_close(map->wal);
+        free(map->wal);
+    }
+
+    if (map->concurrent) {
+        for (u32 k = 0; k <= map->latch_mask; ++k)
+            pthread_mutex_destroy(map->latches + k);
+        pthread_mutex_destroy(&map->policy_lock);
+        pthread_mutex_destroy(&map->retire_lock);
+        pthread_rwlock_destroy(&map->table_lock);
+        free(map->latches);
+    }
+
+    free(map->pinned);
+    free(map->retired);
+    free(map->ops);
+    free(map->older);
+    free(map->newer);
+    free(map->heat);
+    free(map->deep_hits);
+    free(map->deep_tags);
+    free(map->visits);
+    free(map->buckets);
+}
+
+void hash_map_deinit(HashMap *map) {
+    if (map->maintenance)
+        hash_map_stop_maintenance(map);
+
+    for (u32 i = 0; i < map->cap; ++i) {
+        Ptr ptr = map->buckets[i];
+
+        while (!is_null_ptr(ptr)) {
+            Bucket *bucket = ta_acquire_read(map->ta, ptr);
+            Ptr to_free = ptr;
+            ptr = bucket->next;
+            ta_destroy(map->ta, to_free);
+        }
+    }
+
+    for (u64 k = 0; k < map->num_retired; ++k)
+        ta_destroy(map->ta, map->retired[k]);
+
+    hash_map_free(map);
+}
+
+// Lock order: table lock, then a chain latch, then the policy lock. Policy
+// code that needs another chain only ever try-locks its latch.
+static void table_read_lock(HashMap *map) {
+    if (map->concurrent)
+        pthread_rwlock_rdlock(&map->table_lock);
+}
+
+static void table_write_lock(HashMap *map) {
+    if (map->concurrent)
+        pthread_rwlock_wrlock(&map->table_lock);
+}
+
+static void table_unlock(HashMap *map) {
+    if (map->concurrent)
+        pthread_rwlock_unlock(&map->table_lock);
+}
+
+static void latch(HashMap *map, u32 i) {
+    if (map->concurrent)
+        pthread_mutex_lock(map->latches + (i & map->latch_mask));
+}
+
+static bool try_latch(HashMap *map, u32 i) {
+    if (!map->concurrent)
+        return true;
+    return pthread_mutex_trylock(map->latches + (i & map->latch_mask)) == 0;
+}
+
+static void unlatch(HashMap *map, u32 i) {
+    if (map->concurrent)
+        pthread_mutex_unlock(map->latches + (i & map->latch_mask));
+}
+
+static void policy_lock(HashMap *map) {
+    if (map->concurrent)
+        pthread_mutex_lock(&map->policy_lock);
+}
+
+static void policy_unlock(HashMap *map) {
+    if (map->concurrent)
+        pthread_mutex_unlock(&map->policy_lock);
+}
+
+// The set comes from the hash scrambled so that keys of one chain spread
+// over many sets
+static FrontSet *front_set(HashMap *map, u32 hash, u32 *set) {
+    u32 bits = map->front.set_bits;
+    *set = bits == 0 ? 0 : (hash * 0x9e3779b1u) >> (32 - bits);
+    if (map->concurrent)
+        pthread_mutex_lock(map->front.locks + *set);
+    return map->front.sets + *set;
+}
+
+static void front_unlock(HashMap *map, u32 set) {
+    if (map->concurrent)
+        pthread_mutex_unlock(map->front.locks + set);
+}
+
+static i32 front_way(FrontSet *fs, const char *key, u32 key_size, u32 hash) {
+    for (u32 w = 0; w < FRONT_WAYS; ++w) {
+        if (fs->hashes[w] == hash && fs->lens[w] == key_size + 1 &&
+            memcmp(fs->keys[w], key, key_size) == 0)
+            return w;
+    }
+    return -1;
+}
+
+static bool front_cached(HashMap *map, u32 key_size) {
+    return map->front.sets && key_size <= FRONT_KEY_MAX;
+}
+
+static bool front_get(
+    HashMap *map, const char *key, u32 key_size, u32 hash, u64 *value
+) {
+    if (!front_cached(map, key_size))
+        return false;
+
+    u32 set;
+    FrontSet *fs = front_set(map, hash, &set);
+    i32 w = front_way(fs, key, key_size, hash);
+    if (w >= 0) {
+        *value = fs->values[w];
+        fs->refs |= 1 << w;
+    }
+    front_unlock(map, set);
+
+    u64 *stat = w >= 0 ? &map->front.hits : &map->front.misses;
+    __atomic_fetch_add(stat, 1, __ATOMIC_RELAXED);
+    return w >= 0;
+}
+
+// Stores the value the chain now holds for key, replacing the first
+// unreferenced way past the clock hand when the key is not cached yet. The
+// caller holds the chain latch so the cache follows the chain's order of
+// updates.
+static void front_put(
+    HashMap *map, const char *key, u32 key_size, u32 hash, u64 value
+) {
+    if (!front_cached(map, key_size))
+        return;
+
+    u32 set;
+    FrontSet *fs = front_set(map, hash, &set);
+    i32 w = front_way(fs, key, key_size, hash);
+
+    if (w < 0) {
+        while (fs->lens[fs->hand] != 0 && fs->refs & 1 << fs->hand) {
+            fs->refs &= ~(1 << fs->hand);
+            fs->hand = (fs->hand + 1) % FRONT_WAYS;
+        }
+
+        w = fs->hand;
+        fs->hand = (fs->hand + 1) % FRONT_WAYS;
+        fs->hashes[w] = hash;
+        fs->lens[w] = key_size + 1;
+        memcpy(fs->keys[w], key, key_size);
+    }
+
+    fs->values[w] = value;
+    fs->refs |= 1 << w;
+    front_unlock(map, set);
+}
+
+static void front_remove(
+    HashMap *map, const char *key, u32 key_size, u32 hash
+) {
+    if (!front_cached(map, key_size))
+        return;
+
+    u32 set;
+    FrontSet *fs = front_set(map, hash, &set);
+    i32 w = front_way(fs, key, key_size, hash);
+    if (w >= 0) {
+        fs->lens[w] = 0;
+        fs->refs &= ~(1 << w);
+    }
+    front_unlock(map, set);
+}
+
+// Counters written by one thread at a time and read by hash_map_stats
+static void stat_add(u64 *stat, u64 delta) {
+    __atomic_store_n(stat, *stat + delta, __ATOMIC_RELAXED);
+}
+
+// Counters of the stripe of chain i, whose latch the caller holds
+static OpCounters *op_counters(HashMap *map, u32 i) {
+    return map->ops + (i & map->latch_mask);
+}
+
+static void set_visited(HashMap *map, u32 i, bool visited) {
+    __atomic_store_n(map->visits + i, visited, __ATOMIC_RELAXED);
+}
+
+static bool get_visited(HashMap *map, u32 i) {
+    return __atomic_load_n(map->visits + i, __ATOMIC_RELAXED);
+}
+
+static void add_in_ram(HashMap *map, i32 delta) {
+    __atomic_fetch_add(&map->in_ram, delta, __ATOMIC_RELAXED);
+}
+
+static void add_size(HashMap *map, i32 delta) {
+    __atomic_fetch_add(&map->size, delta, __ATOMIC_RELAXED);
+}
+
+static void queue_push(HashMap *map, BucketQueue *queue, u32 i) {
+    map->newer[i] = NIL_BUCKET;
+    map->older[i] = queue->head;
+
+    if (queue->head != NIL_BUCKET)
+        map->newer[queue->head] = i;
+    else
+        queue->tail = i;
+
+    queue->head = i;
+}
+
+static void queue_unlink(HashMap *map, BucketQueue *queue, u32 i) {
+    if (queue == &map->ram_queue && map->hand == i)
+        map->hand = map->newer[i];
+
+    if (map->newer[i] != NIL_BUCKET)
+        map->older[map->newer[i]] = map->older[i];
+    else
+        queue->head = map->older[i];
+
+    if (map->older[i] != NIL_BUCKET)
+        map->newer[map->older[i]] = map->newer[i];
+    else
+        queue->tail = map->newer[i];
+}
+
+static u32 bucket_index(HashMap *map, u32 hash) {
+    u32 n = map->base_cap << map->level;
+    u32 i = hash % n;
+    if (i < map->split)
+        i = hash % ((u64) n << 1);
+    return i;
+}
+
+static bool can_fit(Bucket *bucket, u32 entry_size) {
+    return bucket->count < bucket->slots &&
+           bucket->space >= entry_size + sizeof(Entry) + 8;
+}
+
+static u8 compute_sentinel(u32 hash) {
+    return (hash >> 25) << 1;
+}
+
+static u8 compute_tag(u32 hash) {
+    return hash >> 24;
+}
+
+static bool entry_eq(
+    const Entry *entry_a, const char *key_b, u32 key_size_b, u32 key_hash_b
+) {
+    if (entry_a->size != key_to_entry_size(key_size_b))
+        return false;
+    if (entry_a->sentinel != compute_sentinel(key_hash_b))
+        return false;
+    return memcmp(entry_a->key, key_b, key_size_b) == 0;
+}
+
+static Entry *next_entry(Entry *entry) {
+    return (Entry *) ((u8 *) entry + align_u64(entry->size));
+}
+
+static bool is_end(Entry *entry) {
+    return entry->sentinel == SENTINEL_END;
+}
+
+static bool in_bucket(Bucket *bucket, void *addr, u32 bucket_size) {
+    return (u64) addr - (u64) bucket < bucket_size;
+}
+
+static u16 *bucket_offsets(Bucket *bucket) {
+    return (u16 *) (bucket->tags + bucket->slots);
+}
+
+static Entry *bucket_data(Bucket *bucket) {
+    return (Entry *) ((u8 *) bucket + header_size(bucket->slots));
+}
+
+static Entry *bucket_entry(Bucket *bucket, u32 slot) {
+    u64 offset = (u64) bucket_offsets(bucket)[slot] << 3;
+    return (Entry *) ((u8 *) bucket_data(bucket) + offset);
+}
+
+static Entry *bucket_end(Bucket *bucket) {
+    if (bucket->count == 0)
+        return bucket_data(bucket);
+    return next_entry(bucket_entry(bucket, bucket->count - 1));
+}
+
+static void bucket_set_end(HashMap *map, Bucket *bucket, Entry *end) {
+    ASSERT(in_bucket(bucket, &end->sentinel, map->ta->chunk_size));
+    end->sentinel = SENTINEL_END;
+    bucket->space = map->ta->chunk_size - ((u64) &end->key - (u64) bucket);
+}
+
+static void bucket_init(HashMap *map, Bucket *bucket) {
+    bucket->count = 0;
+    bucket->slots = bucket_slots(map->ta->chunk_size);
+    bucket_set_end(map, bucket, bucket_data(bucket));
+}
+
+static void bucket_push_slot(Bucket *bucket, Entry *entry, u8 tag) {
+    ASSERT(bucket->count < bucket->slots);
+    u64 offset = (u8 *) entry - (u8 *) bucket_data(bucket);
+    bucket->tags[bucket->count] = tag;
+    bucket_offsets(bucket)[bucket->count] = offset >> 3;
+    bucket->count += 1;
+}
+
+// Copies entry behind the last one of bucket, which must have room for it
+static void bucket_append(
+    HashMap *map, Bucket *bucket, const Entry *entry, u8 tag
+) {
+    Entry *end = bucket_end(bucket);
+    memcpy(end, entry, align_u64(entry->size));
+    bucket_push_slot(bucket, end, tag);
+    bucket_set_end(map, bucket, next_entry(end));
+}
+
+// Slides the following entries, including the end marker, over the entry in
+// slot
+static void bucket_remove_slot(HashMap *map, Bucket *bucket, u32 slot) {
+    Entry *entry = bucket_entry(bucket, slot);
+    Entry *end = bucket_end(bucket);
+    Entry *next = next_entry(entry);
+    u64 removed = (u8 *) next - (u8 *) entry;
+    memmove(entry, next, (u8 *) &end->key - (u8 *) next);
+
+    u16 *offsets = bucket_offsets(bucket);
+    for (u32 k = slot + 1; k < bucket->count; ++k) {
+        bucket->tags[k - 1] = bucket->tags[k];
+        offsets[k - 1] = offsets[k] - (removed >> 3);
+    }
+    bucket->count -= 1;
+    bucket_set_end(map, bucket, (Entry *) ((u8 *) end - removed));
+}
+
+// Bit k of the result is set when tags[base + k] matches, for the group of
+// TAG_GROUP slots from base. The 16 byte load may run past the tags into the
+// offsets, which the chunk always holds.
+static u32 bucket_match(Bucket *bucket, u32 base, u8 tag) {
+    u32 n = bucket->count - base;
+#ifdef __SSE2__
+    __m128i tags = _mm_loadu_si128((const __m128i *) (bucket->tags + base));
+    u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag)));
+#else
+    u32 mask = 0;
+    for (u32 k = 0; k < n && k < TAG_GROUP; ++k)
+        mask |= (u32) (bucket->tags[base + k] == tag) << k;
+#endif
+    return n >= TAG_GROUP ? mask : mask & ((1U << n) - 1);
+}
+
+// Returns the slot holding key, or -1
+static i32 bucket_probe(
+    Bucket *bucket, const char *key, u32 key_size, u32 hash
+) {
+    u8 tag = compute_tag(hash);
+
+    for (u32 base = 0; base < bucket->count; base += TAG_GROUP) {
+        u32 mask = bucket_match(bucket, base, tag);
+
+        while (mask) {
+            u32 slot = base + __builtin_ctz(mask);
+            if (entry_eq(bucket_entry(bucket, slot), key, key_size, hash))
+                return slot;
+            mask &= mask - 1;
+        }
+    }
+
+    return -1;
+}
+
+static u64 bucket_used(Bucket *bucket) {
+    return (u8 *) bucket_end(bucket) - (u8 *) bucket_data(bucket);
+}
+
+// The returned entry lives in a chunk that is still read-borrowed
+static Entry *hash_map_find(
+    HashMap *map, Ptr root, const char *key, u32 key_size, u32 hash,
+    Ptr *out_bucket_ptr
+) {
+    Ptr bucket_ptr = root;
+
+    while (!is_null_ptr(bucket_ptr)) {
+        Bucket *bucket = ta_acquire_read(map->ta, bucket_ptr);
+        i32 slot = bucket_probe(bucket, key, key_size, hash);
+
+        if (slot >= 0) {
+            *out_bucket_ptr = bucket_ptr;
+            return bucket_entry(bucket, slot);
+        }
+
+        Ptr old = bucket_ptr;
+        bucket_ptr = bucket->next;
+        ta_release(map->ta, old);
+    }
+
+    return NULL;
+}
+
+// SSD chunks saved by the last checkpoint are never written, so that a crash
+// finds them as they were saved
+static bool is_pinned(HashMap *map, Ptr ptr) {
+    if (map->pinned == NULL || get_tier(ptr) != TIER_SSD)
+        return false;
+
+    u64 chunk_num = ((ptr << 2) >> 2) / chunk_bound(map->ta->chunk_size);
+    return map->pinned[chunk_num >> 6] >> (chunk_num & 63) & 1;
+}
+
+// Keeps a pinned chunk the map no longer uses for the next checkpoint to free
+static void chunk_retire(HashMap *map, Ptr ptr) {
+    if (map->concurrent)
+        pthread_mutex_lock(&map->retire_lock);
+
+    if (map->num_retired == map->retired_cap) {
+        map->retired_cap = map->retired_cap ? map->retired_cap * 2 : 64;
+        map->retired = realloc(
+            map->retired, map->retired_cap * sizeof(*map->retired)
+        );
+        ASSERT(map->retired);
+    }
+    map->retired[map->num_retired++] = ptr;
+
+    if (map->concurrent)
+        pthread_mutex_unlock(&map->retire_lock);
+}
+
+// Like ta_migrate, but a pinned chunk is copied and retired
+static Ptr chunk_migrate(HashMap *map, Ptr ptr, MemoryTier tier) {
+    if (!is_pinned(map, ptr))
+        return ta_migrate(map->ta, ptr, tier);
+
+    Ptr new = ta_create(map->ta, tier);
+    void *src = ta_acquire_read(map->ta, ptr);
+    void *dst = ta_acquire(map->ta, new);
+    memcpy(dst, src, map->ta->chunk_size);
+    ta_release(map->ta, ptr);
+    chunk_retire(map, ptr);
+    return new;
+}
+
+// Moves every chunk of chain i to the given tier
+static void migrate_chain(HashMap *map, u32 i, MemoryTier tier) {
+    map->buckets[i] = chunk_migrate(map, map->buckets[i], tier);
+    Ptr bucket_ptr = map->buckets[i];
+    Bucket *bucket = ta_acquire_raw(map->ta, bucket_ptr);
+
+    while (true) {
+        Ptr next_ptr = bucket->next;
+        if (is_null_ptr(next_ptr))
+            break;
+        Ptr new = chunk_migrate(map, next_ptr, tier);
+        bucket->next = new;
+        ta_flush(map->ta, bucket_ptr);
+        bucket_ptr = new;
+        bucket = ta_acquire_raw(map->ta, new);
+    }
+
+    ta_flush(map->ta, bucket_ptr);
+}
+
+// Gives chain i chunks of its own before it is written, whose latch the
+// caller holds. Chains are pinned as a whole, so the head tells.
+static void chain_thaw(HashMap *map, u32 i) {
+    if (is_pinned(map, map->buckets[i]))
+        migrate_chain(map, i, TIER_SSD);
+}
+
+static u8 *sketch_counter(HashMap *map, u32 i, u32 row) {
+    static const u64 seeds[SKETCH_DEPTH] = {
+        0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+        0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+    };
+    FreqSketch *sketch = &map->sketch;
+    u64 column = 0;
+    if (sketch->width_bits > 0)
+        column = ((u64) i + 1) * seeds[row] >> (64 - sketch->width_bits);
+    return sketch->counters + ((u64) row << sketch->width_bits) + column;
+}
+
+// Counts an access to chain i. Racing increments may be lost, which the
+// estimate tolerates.
+static void sketch_add(HashMap *map, u32 i) {
+    FreqSketch *sketch = &map->sketch;
+    if (!sketch->counters)
+        return;
+
+    for (u32 row = 0; row < SKETCH_DEPTH; ++row) {
+        u8 *counter = sketch_counter(map, i, row);
+        u8 count = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        if (count < SKETCH_MAX)
+            __atomic_store_n(counter, count + 1, __ATOMIC_RELAXED);
+    }
+
+    u64 sample = (u64) SKETCH_SAMPLE << sketch->width_bits;
+    if (__atomic_add_fetch(&sketch->ticks, 1, __ATOMIC_RELAXED) < sample)
+        return;
+
+    policy_lock(map);
+    if (__atomic_load_n(&sketch->ticks, __ATOMIC_RELAXED) >= sample) {
+        u64 n = (u64) SKETCH_DEPTH << sketch->width_bits;
+        for (u64 k = 0; k < n; ++k) {
+            u8 *counter = sketch->counters + k;
+            u8 count = __atomic_load_n(counter, __ATOMIC_RELAXED);
+            __atomic_store_n(counter, count >> 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&sketch->ticks, 0, __ATOMIC_RELAXED);
+    }
+    policy_unlock(map);
+}
+
+static u8 sketch_estimate(HashMap *map, u32 i) {
+    u8 estimate = SKETCH_MAX;
+    for (u32 row = 0; row < SKETCH_DEPTH; ++row) {
+        u8 *counter = sketch_counter(map, i, row);
+        u8 count = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        if (count < estimate)
+            estimate = count;
+    }
+    return estimate;
+}
+
+// SIEVE: the hand sweeps from the oldest RAM chain towards the newest,
+// clearing visited bits, and demotes the first unvisited chain it meets. The
+// hand persists across calls so each eviction is amortized O(1).
+static u32 sieve_victim(HashMap *map) {
+    u32 hand = map->hand;
+    if (hand == NIL_BUCKET)
+        hand = map->ram_queue.tail;
+
+    while (get_visited(map, hand)) {
+        set_visited(map, hand, false);
+        hand = map->newer[hand];
+        if (hand == NIL_BUCKET)
+            hand = map->ram_queue.tail;
+    }
+
+    map->hand = map->newer[hand];
+    return hand;
+}
+
+// Whether chain i may take a RAM slot. Once RAM is full it has to have been
+// used more often than the SIEVE victim it would displace, and the hand is
+// left on that victim for the eviction that follows. Runs under the policy
+// lock.
+static bool admit(HashMap *map, u32 i) {
+    FreqSketch *sketch = &map->sketch;
+    if (!sketch->counters || map->in_ram < map->ram_buckets ||
+        map->ram_queue.tail == NIL_BUCKET)
+        return true;
+
+    u32 victim = sieve_victim(map);
+    map->hand = victim;
+
+    bool admitted = sketch_estimate(map, i) > sketch_estimate(map, victim);
+    u64 *stat = admitted ? &sketch->admitted : &sketch->rejected;
+    __atomic_fetch_add(stat, 1, __ATOMIC_RELAXED);
+    return admitted;
+}
+
+// Demotes the SIEVE victim to CXL, returns false when its chain is latched
+// by another thread. Runs under the policy lock.
+static bool evict_one(HashMap *map) {
+    u32 victim = sieve_victim(map);
+    if (!try_latch(map, victim))
+        return false;
+
+    queue_unlink(map, &map->ram_queue, victim);
+    migrate_chain(map, victim, TIER_CXL);
+    queue_push(map, &map->cxl_queue, victim);
+    add_in_ram(map, -1);
+    stat_add(&map->evictions, 1);
+    unlatch(map, victim);
+    return true;
+}
+
+// Demotes the least recently used CXL chain to SSD, requeueing it when it is
+// latched by another thread. Runs under the policy lock.
+static bool demote_one(HashMap *map) {
+    u32 victim = map->cxl_queue.tail;
+    queue_unlink(map, &map->cxl_queue, victim);
+
+    if (!try_latch(map, victim)) {
+        queue_push(map, &map->cxl_queue, victim);
+        return false;
+    }
+
+    migrate_chain(map, victim, TIER_SSD);
+    stat_add(&map->demotions, 1);
+    unlatch(map, victim);
+    return true;
+}
+
+// Runs under the policy lock. A victim whose chain is latched by another
+// thread is passed over, so a concurrent map may briefly stay above ram_low.
+static void hash_map_evict(HashMap *map) {
+    u32 attempts = 2 * map->in_ram;
+
+    while (map->in_ram > map->ram_low && attempts-- > 0)
+        evict_one(map);
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// "some avg10" of the system's memory pressure in hundredths of a percent, 0
+// when the kernel does not report it
+static u32 memory_pressure(void) {
+    FILE *file = fopen("/proc/pressure/memory", "r");
+    if (!file)
+        return 0;
+
+    double avg10 = 0;
+    if (fscanf(file, "some avg10=%lf", &avg10) != 1)
+        avg10 = 0;
+    fclose(file);
+    return avg10 * 100;
+}
+
+// One step of the RAM controller (see hash_map_set_ram_target) over the
+// acquires sampled since the last one. The caller holds the table lock, and
+// rebalancing afterwards evicts down to a reduced budget.
+static void ram_control(HashMap *map) {
+    RamControl *control = &map->control;
+    u64 now = now_ns();
+    u64 last = __atomic_load_n(&control->last_ns, __ATOMIC_RELAXED);
+    if (now - last < CONTROL_PERIOD_NS ||
+        !__atomic_compare_exchange_n(
+            &control->last_ns, &last, now, false, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED
+        ))
+        return;
+
+    u32 pressure = control->pressure_limit ? memory_pressure() : 0;
+    TieredAllocator *ta = map->ta;
+    TaStats stats;
+    ta_stats(ta, &stats);
+    policy_lock(map);
+
+    u64 samples = 0;
+    u64 sample_ns = 0;
+    u64 cold = 0;
+    for (u32 tier = 0; tier < NUM_TIERS; ++tier) {
+        TierStats *tier_stats = stats.tiers + tier;
+        u64 n = 0;
+        for (u32 b = 0; b < LATENCY_BUCKETS; ++b)
+            n += tier_stats->acquire_hist[b];
+        u64 ns = tier_stats->acquire_ns;
+        samples += n - control->samples[tier];
+        sample_ns += ns - control->sample_ns[tier];
+        if (tier != TIER_RAM)
+            cold += n - control->samples[tier];
+        control->samples[tier] = n;
+        control->sample_ns[tier] = ns;
+    }
+
+    u64 ram = ta_memory_usage(ta, TIER_RAM);
+    u64 used = ram + ta_memory_usage(ta, TIER_CXL);
+    u64 per_chain = map->in_ram ? ram / map->in_ram : ta->chunk_size;
+    u64 mean_ns = samples ? sample_ns / samples : 0;
+
+    // Budgets stay at 1 or more, a map without RAM is left alone
+    u64 budget = map->ram_buckets;
+    u64 step = (budget >> CONTROL_STEP_SHIFT) + 1;
+    u64 cut = (budget >> CONTROL_CUT_SHIFT) + 1;
+    bool room = control->max_bytes == 0 ||
+                used + step * per_chain <= control->max_bytes;
+
+    // Without a latency goal RAM only grows toward max_bytes, and without
+    // either goal it does not grow at all
+    bool slow = control->latency_ns != 0 ? mean_ns >= control->latency_ns
+                                         : control->max_bytes != 0;
+
+    if ((control->max_bytes != 0 && used > control->max_bytes) ||
+        (control->pressure_limit != 0 && pressure > control->pressure_limit))
+        budget = budget > cut ? budget - cut : 1;
+    else if (cold > 0 && room && slow)
+        budget += step;
+    else if (control->latency_ns != 0 && samples > 0 &&
+             mean_ns < control->latency_ns / 2)
+        budget = budget > step ? budget - step : 1;
+
+    if (budget > map->cap)
+        budget = map->cap;
+
+    if (budget != map->ram_buckets && map->ram_buckets != 0) {
+        u64 low = budget * control->low_share >> 16;
+        stat_add(
+            budget > map->ram_buckets ? &control->grows : &control->shrinks, 1
+        );
+        __atomic_store_n(&map->ram_low, low, __ATOMIC_RELAXED);
+        __atomic_store_n(&map->ram_buckets, budget, __ATOMIC_RELAXED);
+    }
+
+    policy_unlock(map);
+}
+
+static bool cxl_over(HashMap *map, u64 budget) {
+    return ta_memory_usage(map->ta, TIER_CXL) > budget;
+}
+
+static bool over_budget(HashMap *map) {
+    u32 in_ram = __atomic_load_n(&map->in_ram, __ATOMIC_RELAXED);
+    return in_ram > __atomic_load_n(&map->ram_buckets, __ATOMIC_RELAXED) ||
+           cxl_over(map, map->cxl_budget);
+}
+
+// Past this point foreground operations stop leaving eviction and demotion
+// to the maintenance worker
+static bool over_slack(HashMap *map) {
+    u64 in_ram = __atomic_load_n(&map->in_ram, __ATOMIC_RELAXED);
+    u64 ram_buckets = __atomic_load_n(&map->ram_buckets, __ATOMIC_RELAXED);
+    u64 ram_slack = ram_buckets >> MAINT_SLACK_SHIFT;
+    u64 cxl_slack = map->cxl_budget >> MAINT_SLACK_SHIFT;
+    u64 cxl_limit = map->cxl_budget > UINT64_MAX - cxl_slack
+                        ? UINT64_MAX
+                        : map->cxl_budget + cxl_slack;
+
+    return in_ram > ram_buckets + ram_slack ||
+           cxl_over(map, cxl_limit);
+}
+
+static void maintenance_wake(HashMap *map) {
+    if (__atomic_exchange_n(&map->maint_pending, true, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&map->maint_lock);
+    pthread_cond_signal(&map->maint_cond);
+    pthread_mutex_unlock(&map->maint_lock);
+}
+
+// Keeps RAM under its bucket budget and CXL under its byte budget. Chains
+// pushed out of CXL go to SSD in least recently used order. The caller holds
+// the table lock but no latch.
+static void hash_map_rebalance(HashMap *map) {
+    RamControl *control = &map->control;
+    if (control->enabled && !map->maintenance) {
+        u32 ticks = __atomic_add_fetch(&control->ticks, 1, __ATOMIC_RELAXED);
+        if (ticks % CONTROL_OPS == 0)
+            ram_control(map);
+    }
+
+    if (!over_budget(map))
+        return;
+
+    if (map->maintenance) {
+        maintenance_wake(map);
+        if (!over_slack(map))
+            return;
+    }
+
+    policy_lock(map);
+
+    if (map->in_ram > map->ram_buckets) {
+        hash_map_evict(map);
+        ASSERT(map->concurrent || map->in_ram == map->ram_low);
+    }
+
+    u32 attempts = 2 * map->cap;
+
+    while (cxl_over(map, map->cxl_budget) &&
+           map->cxl_queue.tail != NIL_BUCKET && attempts-- > 0)
+        demote_one(map);
+
+    policy_unlock(map);
+}
+
+// Records a hit on chain i, whose latch the caller holds. Cold chains
+// accumulate heat, which is halved every cap cold hits, and are promoted back
+// to RAM once hot enough.
+static void hash_map_touch(HashMap *map, u32 i) {
+    MemoryTier tier = get_tier(map->buckets[i]);
+    sketch_add(map, i);
+
+    if (tier == TIER_RAM) {
+        set_visited(map, i, true);
+        return;
+    }
+
+    bool promote = false;
+    policy_lock(map);
+
+    if (tier == TIER_CXL) {
+        queue_unlink(map, &map->cxl_queue, i);
+        queue_push(map, &map->cxl_queue, i);
+    }
+
+    if (map->promote_threshold != 0 && map->ram_buckets != 0) {
+        if (++map->cold_hits >= map->cap) {
+            for (u32 j = 0; j < map->cap; ++j)
+                map->heat[j] >>= 1;
+            map->cold_hits = 0;
+        }
+
+        if (map->heat[i] < UINT8_MAX)
+            map->heat[i] += 1;
+        promote = map->heat[i] >= map->promote_threshold;
+    }
+
+    // A chain turned away keeps its heat and is offered again on its next hit
+    promote = promote && admit(map, i);
+
+    if (promote) {
+        if (tier == TIER_CXL)
+            queue_unlink(map, &map->cxl_queue, i);
+        map->heat[i] = 0;
+        stat_add(&map->promotions, 1);
+    }
+
+    policy_unlock(map);
+
+    if (!promote)
+        return;
+
+    // Start with the visited bit set so the chain survives the eviction it
+    // is about to cause
+    migrate_chain(map, i, TIER_RAM);
+    policy_lock(map);
+    queue_push(map, &map->ram_queue, i);
+    set_visited(map, i, true);
+    add_in_ram(map, 1);
+    policy_unlock(map);
+}
+
+static void hash_map_check(HashMap *map) {
+    /* u64 count = 0; */
+
+    /* for (u64 i = 0; i < map->cap; ++i) { */
+    /*     Ptr bucket_ptr = map->buckets[i]; */
+
+    /*     while (!is_null_ptr(bucket_ptr)) { */
+    /*         ASSERT(ta_ptr_valid(map->ta, bucket_ptr)); */
+    /*         Bucket *bucket = ta_acquire_raw(map->ta, bucket_ptr); */
+
+    /*         for (Entry *entry = bucket_data(bucket); !is_end(entry); */
+    /*              entry = next_entry(entry)) */
+    /*             count += 1; */
+
+    /*         bucket_ptr = bucket->next; */
+    /*     } */
+    /* } */
+
+    /* ASSERT(count == map->size); */
+    (void) map;
+}
+
+// Whether the entries of next fit behind `used` bytes and `count` slots
+static bool can_merge(HashMap *map, u64 used, u32 count, Bucket *next) {
+    u64 room = map->ta->chunk_size - header_size(next->slots) - sizeof(Entry);
+    return used + bucket_used(next) <= room &&
+           count + next->count <= next->slots;
+}
+
+// Appends the entries of bucket->next to bucket and frees that chunk when
+// both fit in one. The bucket must be borrowed for writing.
+static void bucket_merge_next(HashMap *map, Bucket *bucket) {
+    if (is_null_ptr(bucket->next))
+        return;
+
+    Ptr next_ptr = bucket->next;
+    Bucket *next = ta_acquire_read(map->ta, next_ptr);
+    u64 used = bucket_used(bucket);
+    u64 next_used = bucket_used(next);
+
+    if (!can_merge(map, used, bucket->count, next)) {
+        ta_release(map->ta, next_ptr);
+        return;
+    }
+
+    u8 *data = (u8 *) bucket_data(bucket);
+    Entry *end = (Entry *) (data + used + next_used);
+    memcpy(data + used, bucket_data(next), next_used);
+
+    u16 *offsets = bucket_offsets(bucket);
+    u16 *next_offsets = bucket_offsets(next);
+    for (u32 k = 0; k < next->count; ++k) {
+        bucket->tags[bucket->count + k] = next->tags[k];
+        offsets[bucket->count + k] = next_offsets[k] + (used >> 3);
+    }
+    bucket->count += next->count;
+    bucket_set_end(map, bucket, end);
+    bucket->next = next->next;
+    ta_destroy(map->ta, next_ptr);
+}
+
+// Detaches chain i from whichever residency queue holds it once its last
+// chunk is gone
+static void chain_emptied(HashMap *map, u32 i, MemoryTier tier) {
+    policy_lock(map);
+
+    if (tier == TIER_RAM) {
+        queue_unlink(map, &map->ram_queue, i);
+        add_in_ram(map, -1);
+    }
+    else if (tier == TIER_CXL) {
+        queue_unlink(map, &map->cxl_queue, i);
+    }
+
+    set_visited(map, i, false);
+    map->heat[i] = 0;
+    policy_unlock(map);
+}
+
+// Merges neighbouring chunks of chain i, whose latch the caller holds,
+// wherever they fit in one. Only one chunk is read-borrowed at a time and a
+// chunk is borrowed for writing only when a merge will happen.
+static void chain_compact(HashMap *map, u32 i) {
+    Ptr bucket_ptr = map->buckets[i];
+    if (is_pinned(map, bucket_ptr))
+        return;
+
+    while (!is_null_ptr(bucket_ptr)) {
+        Bucket *bucket = ta_acquire_read(map->ta, bucket_ptr);
+        Ptr next_ptr = bucket->next;
+        u64 used = bucket_used(bucket);
+        u32 count = bucket->count;
+        ta_release(map->ta, bucket_ptr);
+
+        if (is_null_ptr(next_ptr))
+            break;
+
+        Bucket *next = ta_acquire_read(map->ta, next_ptr);
+        bool merge = can_merge(map, used, count, next);
+        ta_release(map->ta, next_ptr);
+
+        if (!merge) {
+            bucket_ptr = next_ptr;
+            continue;
+        }
+
+        // Stay on this chunk, the one after may fit as well
+        bucket = ta_acquire(map->ta, bucket_ptr);
+        bucket_merge_next(map, bucket);
+        ta_flush(map->ta, bucket_ptr);
+        __atomic_fetch_add(&map->merges, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Hits past the head chunk of chain i vote for a candidate entry, known by
+// its tag: a hit on the candidate counts up, any other takes one off and
+// replaces the candidate once the count is gone. When the count reaches
+// raise_period the entry that was hit, which lies in the chunk at bucket_ptr,
+// moves to the head, so only an entry that dominates the deep hits of its
+// chain is raised. Where the head is full it trades places with the entry
+// that has been there longest. Hot entries so gather where a lookup in a cold
+// tier finds them with a single chunk decompressed or read, and the rest sink
+// behind them. Chains still pinned by a checkpoint are left as they are. The
+// caller holds the latch of the chain and no borrow.
+static void chain_raise(
+    HashMap *map, u32 i, Ptr bucket_ptr, const char *key, u32 key_size,
+    u32 hash
+) {
+    Ptr head_ptr = map->buckets[i];
+    if (map->raise_period == 0 || bucket_ptr == head_ptr ||
+        is_pinned(map, head_ptr))
+        return;
+
+    u8 tag = compute_tag(hash);
+    if (map->deep_tags[i] != tag && map->deep_hits[i] > 0) {
+        map->deep_hits[i] -= 1;
+        return;
+    }
+    map->deep_tags[i] = tag;
+    if (++map->deep_hits[i] < map->raise_period)
+        return;
+    map->deep_hits[i] = 0;
+
+    u8 *scratch = ta_thread_scratch(map->ta);
+    Entry *entry = (Entry *) scratch;
+    Entry *sunk = (Entry *) (scratch + chunk_bound(map->ta->chunk_size));
+
+    // Both chunks are read first, since a thread may only read-borrow one
+    // CXL chunk at a time and most raises are expected to be possible
+    Bucket *bucket = ta_acquire_read(map->ta, bucket_ptr);
+    i32 slot = bucket_probe(bucket, key, key_size, hash);
+    ASSERT(slot >= 0);
+    Entry *found = bucket_entry(bucket, slot);
+    memcpy(entry, found, align_u64(found->size));
+    u64 room = bucket->space + align_u64(found->size);
+    bool shared = bucket->count > 1;
+    ta_release(map->ta, bucket_ptr);
+
+    Bucket *head = ta_acquire_read(map->ta, head_ptr);
+    Entry *victim = bucket_entry(head, 0);
+    u64 head_room = head->space + align_u64(victim->size);
+    bool move = shared && can_fit(head, entry->size);
+    bool swap = !move &&
+                head_room >= entry->size + sizeof(Entry) + 8 &&
+                room >= victim->size + sizeof(Entry) + 8;
+
+    if (!move && !swap) {
+        ta_release(map->ta, head_ptr);
+        return;
+    }
+
+    head = ta_upgrade(map->ta, head_ptr);
+    u8 sunk_tag = head->tags[0];
+    if (swap) {
+        victim = bucket_entry(head, 0);
+        memcpy(sunk, victim, align_u64(victim->size));
+        bucket_remove_slot(map, head, 0);
+    }
+    bucket_append(map, head, entry, tag);
+    ta_flush(map->ta, head_ptr);
+
+    bucket = ta_acquire(map->ta, bucket_ptr);
+    bucket_remove_slot(map, bucket, slot);
+    if (swap)
+        bucket_append(map, bucket, sunk, sunk_tag);
+    ta_flush(map->ta, bucket_ptr);
+
+    __atomic_fetch_add(&map->raises, 1, __ATOMIC_RELAXED);
+}
+
+// One round of background work under the table read lock. The policy lock is
+// dropped between victims so that cold hits are not held up behind a run of
+// compressions.
+static void maintenance_pass(HashMap *map) {
+    if (map->control.enabled)
+        ram_control(map);
+
+    bool evict = __atomic_load_n(&map->in_ram, __ATOMIC_RELAXED) >
+                 map->ram_buckets;
+    u32 attempts = 2 * map->cap;
+
+    while (evict && attempts-- > 0) {
+        policy_lock(map);
+        evict = map->in_ram > map->ram_low;
+        if (evict)
+            evict_one(map);
+        policy_unlock(map);
+    }
+
+    attempts = 2 * map->cap;
+    bool demote = true;
+
+    while (demote && attempts-- > 0) {
+        policy_lock(map);
+        demote = cxl_over(map, map->cxl_budget) &&
+                 map->cxl_queue.tail != NIL_BUCKET;
+        if (demote)
+            demote_one(map);
+        policy_unlock(map);
+    }
+
+    for (u32 k = 0; k < COMPACT_BATCH && k < map->cap; ++k) {
+        u32 i = map->compact_cursor++ % map->cap;
+        if (!try_latch(map, i))
+            continue;
+        chain_compact(map, i);
+        unlatch(map, i);
+    }
+}
+
+static void *maintenance_main(void *arg) {
+    HashMap *map = arg;
+
+    pthread_mutex_lock(&map->maint_lock);
+
+    while (!map->maint_stop) {
+        if (!__atomic_load_n(&map->maint_pending, __ATOMIC_RELAXED)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            u64 ns = deadline.tv_nsec + map->maint_period_ms * 1000000ULL;
+            deadline.tv_sec += ns / 1000000000ULL;
+            deadline.tv_nsec = ns % 1000000000ULL;
+            pthread_cond_timedwait(
+                &map->maint_cond, &map->maint_lock, &deadline
+            );
+        }
+
+        if (map->maint_stop)
+            break;
+
+        __atomic_store_n(&map->maint_pending, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&map->maint_lock);
+
+        table_read_lock(map);
+        maintenance_pass(map);
+        table_unlock(map);
+
+        pthread_mutex_lock(&map->maint_lock);
+    }
+
+    pthread_mutex_unlock(&map->maint_lock);
+    return NULL;
+}
+
+void hash_map_start_maintenance(HashMap *map, u32 period_ms) {
+    ASSERT(map->concurrent);
+    ASSERT(!map->maintenance);
+    ASSERT(period_ms > 0);
+
+    map->maint_stop = false;
+    map->maint_pending = false;
+    map->maint_period_ms = period_ms;
+    ASSERT(pthread_mutex_init(&map->maint_lock, NULL) == 0);
+    ASSERT(pthread_cond_init(&map->maint_cond, NULL) == 0);
+    map->maintenance = true;
+    ASSERT(
+        pthread_create(&map->maint_thread, NULL, maintenance_main, map) == 0
+    );
+}
+
+void hash_map_stop_maintenance(HashMap *map) {
+    ASSERT(map->maintenance);
+
+    pthread_mutex_lock(&map->maint_lock);
+    map->maint_stop = true;
+    pthread_cond_signal(&map->maint_cond);
+    pthread_mutex_unlock(&map->maint_lock);
+    ASSERT(pthread_join(map->maint_thread, NULL) == 0);
+
+    pthread_mutex_destroy(&map->maint_lock);
+    pthread_cond_destroy(&map->maint_cond);
+    map->maintenance = false;
+}
+
+void hash_map_close(HashMap *map) {
+    if (map->maintenance)
+        hash_map_stop_maintenance(map);
+
+    hash_map_checkpoint(map);
+    hash_map_free(map);
+}
+
+bool hash_map_open(HashMap *map, TieredAllocator *ta, u32 ram_buckets) {
+    HashMapManifest header;
+    u8 *manifest = ta->manifest;
+
+    if (ta->manifest_size < sizeof(header))
+        return false;
+    memcpy(&header, manifest, sizeof(header));
+
+    u64 buckets_size = (u64) header.cap * sizeof(*map->buckets);
+    if (header.magic != MANIFEST_MAGIC ||
+        header.chunk_size != ta->chunk_size ||
+        ta->manifest_size != sizeof(header) + buckets_size + header.cap)
+        return false;
+
+    hash_map_init(map, ta, header.cap, ram_buckets);
+    map->base_cap = header.base_cap;
+    map->level = header.level;
+    map->split = header.split;
+    map->size = header.size;
+    map->max_load = header.max_load;
+    map->promote_threshold = header.promote_threshold;
+    map->wal_lsn = header.wal_lsn;
+
+    // Every chain stays on SSD until it is used, and is copied by its first
+    // write, since a crash falls back to the saved table
+    memcpy(map->buckets, manifest + sizeof(header), buckets_size);
+    memcpy(map->heat, manifest + sizeof(header) + buckets_size, header.cap);
+    u64 num_chunks = ta->cap / chunk_bound(ta->chunk_size);
+    map->pinned = malloc((num_chunks + 63) / 64 * sizeof(u64));
+    ASSERT(map->pinned);
+    ta_ssd_used(ta, map->pinned);
+    return true;
+}
+
+// Records up to the map's lsn are already part of its table
+static void wal_apply(
+    WalOp op, const char *key, u32 key_size, u64 value, u64 lsn, void *ctx
+) {
+    HashMap *map = ctx;
+    if (lsn <= map->wal_lsn)
+        return;
+
+    char *k = malloc(key_size + 1);
+    ASSERT(k);
+    memcpy(k, key, key_size);
+    k[key_size] = 0;
+
+    if (op == WAL_PUT)
+        hash_map_put(map, k, value);
+    else
+        hash_map_remove(map, k);
+
+    map->wal_lsn = lsn;
+    free(k);
+}
+
+void hash_map_enable_wal(HashMap *map, const char *path, u32 sync_ms) {
+    ASSERT(map->wal == NULL);
+
+    Wal *wal = malloc(sizeof(*wal));
+    ASSERT(wal);
+    // A new log carries on from the records the table already includes
+    wal_open(wal, path, map->wal_lsn + 1, sync_ms, wal_apply, map);
+    map->wal = wal;
+}
+
+// Copies a chain into new SSD chunks and returns the head of the copy. The
+// copies are retired, since only the saved table uses them.
+static Ptr chain_copy(HashMap *map, Ptr bucket_ptr) {
+    Ptr head_ptr = null_ptr();
+    Ptr prev_ptr = null_ptr();
+    Bucket *prev = NULL;
+
+    while (!is_null_ptr(bucket_ptr)) {
+        Ptr copy_ptr = ta_create(map->ta, TIER_SSD);
+        Bucket *copy = ta_acquire(map->ta, copy_ptr);
+        Bucket *bucket = ta_acquire_read(map->ta, bucket_ptr);
+        memcpy(copy, bucket, map->ta->chunk_size);
+        Ptr old = bucket_ptr;
+        bucket_ptr = bucket->next;
+        ta_release(map->ta, old);
+        chunk_retire(map, copy_ptr);
+
+        if (prev) {
+            prev->next = copy_ptr;
+            ta_flush(map->ta, prev_ptr);
+        }
+        else {
+            head_ptr = copy_ptr;
+        }
+        prev = copy;
+        prev_ptr = copy_ptr;
+    }
+
+    if (prev)
+        ta_flush(map->ta, prev_ptr);
+    return head_ptr;
+}
+
+void hash_map_checkpoint(HashMap *map) {
+    HashMapManifest header = {
+        .magic = MANIFEST_MAGIC,
+        .chunk_size = map->ta->chunk_size,
+        .cap = map->cap,
+        .base_cap = map->base_cap,
+        .level = map->level,
+        .split = map->split,
+        .size = map->size,
+        .max_load = map->max_load,
+        .promote_threshold = map->promote_threshold,
+    };
+
+    u64 buckets_size = (u64) map->cap * sizeof(*map->buckets);
+    u64 size = sizeof(header) + buckets_size + map->cap;
+    u8 *manifest = malloc(size);
+    ASSERT(manifest);
+
+    Ptr *buckets = (Ptr *) (manifest + sizeof(header));
+    u8 *heat = manifest + sizeof(header) + buckets_size;
+    memcpy(heat, map->heat, map->cap);
+
+    // Chains on SSD are saved in place and chains in RAM or CXL as copies,
+    // while the chunks of the last checkpoint stay until this one is on disk.
+    // Chains resident in RAM restart hot enough to be promoted by their
+    // first hit.
+    u64 num_retired = map->num_retired;
+    for (u32 i = 0; i < map->cap; ++i) {
+        MemoryTier tier = get_tier(map->buckets[i]);
+        buckets[i] = map->buckets[i];
+        if (tier == TIER_RAM)
+            heat[i] = UINT8_MAX;
+        if (tier == TIER_RAM || tier == TIER_CXL)
+            buckets[i] = chain_copy(map, map->buckets[i]);
+    }
+
+    for (u64 k = 0; k < num_retired; ++k)
+        ta_destroy(map->ta, map->retired[k]);
+    map->num_retired -= num_retired;
+    memmove(
+        map->retired, map->retired + num_retired,
+        map->num_retired * sizeof(*map->retired)
+    );
+
+    // Every SSD chunk left belongs to the saved table
+    if (map->pinned == NULL) {
+        u64 num_chunks = map->ta->cap / chunk_bound(map->ta->chunk_size);
+        map->pinned = malloc((num_chunks + 63) / 64 * sizeof(u64));
+        ASSERT(map->pinned);
+    }
+    ta_ssd_used(map->ta, map->pinned);
+
+    // The log is synced before the table that includes its records is saved
+    if (map->wal) {
+        map->wal_lsn = wal_last_lsn(map->wal);
+        wal_commit(map->wal, map->wal_lsn);
+    }
+
+    header.wal_lsn = map->wal_lsn;
+    memcpy(manifest, &header, sizeof(header));
+    ta_persist(map->ta, manifest, size);
+    free(manifest);
+
+    // Nothing was logged since, so the new log starts out empty
+    if (map->wal) {
+        wal_rewrite_begin(map->wal);
+        wal_rewrite_end(map->wal);
+    }
+}
+
+typedef struct {
+    u32 i;
+    MemoryTier tier;
+    Ptr ptr;
+    Bucket *bucket;
+} ChainBuilder;
+
+// Copies entry into the head chunk of the chain being built, pushing a fresh
+// chunk when it does not fit
+static void builder_append(
+    HashMap *map, ChainBuilder *builder, Entry *entry, u8 tag
+) {
+    if (builder->bucket == NULL || !can_fit(builder->bucket, entry->size)) {
+        if (builder->bucket != NULL)
+            ta_flush(map->ta, builder->ptr);
+
+        builder->ptr = ta_create(map->ta, builder->tier);
+        builder->bucket = ta_acquire(map->ta, builder->ptr);
+        bucket_init(map, builder->bucket);
+        builder->bucket->next = map->buckets[builder->i];
+        map->buckets[builder->i] = builder->ptr;
+    }
+
+    bucket_append(map, builder->bucket, entry, tag);
+}
 
-    for (u32 i = 0; i < cap; ++i)
-        map->buckets[i] = null_ptr();
+static void grow_arrays(HashMap *map) {
+    map->alloc *= 2;
+    map->buckets = realloc(map->buckets, map->alloc * sizeof(*map->buckets));
+    map->visits = realloc(map->visits, map->alloc * sizeof(*map->visits));
+    map->heat = realloc(map->heat, map->alloc * sizeof(*map->heat));
+    map->deep_hits =
+        realloc(map->deep_hits, map->alloc * sizeof(*map->deep_hits));
+    map->deep_tags =
+        realloc(map->deep_tags, map->alloc * sizeof(*map->deep_tags));
+    map->newer = realloc(map->newer, map->alloc * sizeof(*map->newer));
+    map->older = realloc(map->older, map->alloc * sizeof(*map->older));
+
+    ASSERT(map->buckets);
+    ASSERT(map->visits);
+    ASSERT(map->heat);
+    ASSERT(map->deep_hits);
+    ASSERT(map->deep_tags);
+    ASSERT(map->newer);
+    ASSERT(map->older);
 }
 
-void hash_map_deinit(HashMap *map) {
-    for (u32 i = 0; i < map->cap; ++i) {
-        Ptr ptr = map->buckets[i];
+// Linear hashing: moves the entries of chain `split` that now hash to
+// split + n into a new chain in the same tier, compacting what stays behind.
+// Only this one chain is touched, so growth never stalls on a full rehash.
+// Runs under the table write lock.
+static void hash_map_split(HashMap *map) {
+    u32 n = map->base_cap << map->level;
+    u32 src = map->split;
+    u32 dst = src + n;
+
+    if (dst >= map->alloc)
+        grow_arrays(map);
+
+    map->buckets[dst] = null_ptr();
+    map->visits[dst] = false;
+    map->heat[dst] = 0;
+    map->deep_hits[dst] = 0;
+    map->deep_tags[dst] = 0;
+    map->cap += 1;
+    map->split += 1;
+
+    if (map->split == n) {
+        map->level += 1;
+        map->split = 0;
+    }
 
-        while (!is_null_ptr(ptr)) {
-            Bucket *bucket = ta_acquire(map->ta, ptr);
-            Ptr to_free = ptr;
-            ptr = bucket->next;
-            ta_destroy(map->ta, to_free);
+    if (is_null_ptr(map->buckets[src]))
+        return;
+
+    chain_thaw(map, src);
+    MemoryTier tier = get_tier(map->buckets[src]);
+    ChainBuilder builder = {dst, tier, null_ptr(), NULL};
+    Ptr prev_ptr = null_ptr();
+    Ptr bucket_ptr = map->buckets[src];
+
+    while (!is_null_ptr(bucket_ptr)) {
+        Bucket *bucket = ta_acquire(map->ta, bucket_ptr);
+        Entry *kept = bucket_data(bucket);
+        u32 count = bucket->count;
+        bucket->count = 0;
+
+        // Slots are in entry order, so survivors can be packed down in place
+        for (u32 k = 0; k < count; ++k) {
+            Entry *entry = bucket_entry(bucket, k);
+            u8 tag = bucket->tags[k];
+            u64 size = align_u64(entry->size);
+            u32 hash;
+            MurmurHash3_x86_32(
+                entry->key, entry->size - key_to_entry_size(0), 22, &hash
+            );
+
+            if (bucket_index(map, hash) == dst) {
+                builder_append(map, &builder, entry, tag);
+            }
+            else {
+                if (kept != entry)
+                    memmove(kept, entry, size);
+                bucket_push_slot(bucket, kept, tag);
+                kept = (Entry *) ((u8 *) kept + size);
+            }
         }
+
+        bucket_set_end(map, bucket, kept);
+        Ptr next_ptr = bucket->next;
+
+        if (bucket->count == 0) {
+            ta_destroy(map->ta, bucket_ptr);
+
+            if (is_null_ptr(prev_ptr)) {
+                map->buckets[src] = next_ptr;
+            }
+            else {
+                Bucket *prev = ta_acquire(map->ta, prev_ptr);
+                prev->next = next_ptr;
+                ta_flush(map->ta, prev_ptr);
+            }
+        }
+        else {
+            ta_flush(map->ta, bucket_ptr);
+            prev_ptr = bucket_ptr;
+        }
+
+        bucket_ptr = next_ptr;
     }
 
-    free(map->visits);
-    free(map->buckets);
-}
+    if (builder.bucket == NULL)
+        return;
 
-static bool can_fit(u32 bucket_space, u32 entry_size) {
-    return bucket_space >= entry_size + sizeof(Entry) + 8;
-}
+    ta_flush(map->ta, builder.ptr);
+    map->visits[dst] = map->visits[src];
+    map->heat[dst] = map->heat[src];
 
-static u32 key_to_entry_size(u32 key_size) {
-    return key_size + sizeof(Entry) + 1;
-}
+    if (tier == TIER_RAM) {
+        queue_push(map, &map->ram_queue, dst);
+        add_in_ram(map, 1);
+    }
+    else if (tier == TIER_CXL) {
+        queue_push(map, &map->cxl_queue, dst);
+    }
 
-static u8 compute_sentinel(u32 hash) {
-    return (hash >> 25) << 1;
+    if (is_null_ptr(map->buckets[src]))
+        chain_emptied(map, src, tier);
 }
 
-static bool entry_eq(
-    const Entry *entry_a, const char *key_b, u32 key_size_b, u32 key_hash_b
-) {
-    if (entry_a->size != key_to_entry_size(key_size_b))
+static bool should_grow(HashMap *map) {
+    u64 size = __atomic_load_n(&map->size, __ATOMIC_RELAXED);
+
+    if (map->max_load == 0)
         return false;
-    if (entry_a->sentinel != compute_sentinel(key_hash_b))
+    if (size * 100 <= (u64) map->cap * map->max_load)
         return false;
-    return memcmp(entry_a->key, key_b, key_size_b) == 0;
-}
-
-static Entry *next_entry(Entry *entry) {
-    return (Entry *) ((u8 *) entry + align_u64(entry->size));
-}
-
-static bool is_end(Entry *entry) {
-    return entry->sentinel == SENTINEL_END;
+    return ((u64) map->base_cap << (map->level + 1)) <= UINT32_MAX;
 }
 
-static bool in_bucket(Bucket *bucket, void *addr, u32 bucket_size) {
-    return (u64) addr - (u64) bucket < bucket_size;
+// Called without any lock held
+static void hash_map_grow(HashMap *map) {
+    table_write_lock(map);
+    if (should_grow(map))
+        hash_map_split(map);
+    table_unlock(map);
 }
 
-static Entry *hash_map_find(
-    HashMap *map, Ptr root, const char *key, u32 key_size, u32 hash,
-    Ptr *out_bucket_ptr
+// Upsert within chain i, whose latch the caller holds
+static bool chain_upsert(
+    HashMap *map, u32 i, const char *key, u32 key_size, u32 hash,
+    HashMapUpsertFn update, void *ctx
 ) {
-    Ptr bucket_ptr = root;
+    chain_thaw(map, i);
+    u32 entry_size = key_to_entry_size(key_size);
+    Ptr bucket_ptr = map->buckets[i];
+    Ptr fit_ptr = null_ptr();
+    Bucket *bucket = NULL;
+    Entry *entry = NULL;
 
+    // A single pass finds the key or else remembers the first chunk with
+    // room for it. The last chunk is kept borrowed if that is the one.
     while (!is_null_ptr(bucket_ptr)) {
-        Bucket *bucket = ta_acquire(map->ta, bucket_ptr);
+        bucket = ta_acquire_read(map->ta, bucket_ptr);
+        i32 slot = bucket_probe(bucket, key, key_size, hash);
 
-        for (Entry *entry = bucket->data; !is_end(entry);
-             entry = next_entry(entry)) {
-            if (entry_eq(entry, key, key_size, hash)) {
-                *out_bucket_ptr = bucket_ptr;
-                return entry;
-            }
+        if (slot >= 0) {
+            bucket = ta_upgrade(map->ta, bucket_ptr);
+            entry = bucket_entry(bucket, slot);
+            update(&entry->value, true, ctx);
+            ta_flush(map->ta, bucket_ptr);
+
+            chain_raise(map, i, bucket_ptr, key, key_size, hash);
+            hash_map_touch(map, i);
+            return false;
+        }
+
+        if (is_null_ptr(fit_ptr) && can_fit(bucket, entry_size))
+            fit_ptr = bucket_ptr;
+
+        if (is_null_ptr(bucket->next) && fit_ptr == bucket_ptr) {
+            bucket = ta_upgrade(map->ta, bucket_ptr);
+            break;
         }
 
         Ptr old = bucket_ptr;
         bucket_ptr = bucket->next;
-        ta_flush(map->ta, old);
+        ta_release(map->ta, old);
     }
 
-    return NULL;
-}
+    bool existed = !is_null_ptr(map->buckets[i]);
 
-static void hash_map_evict(HashMap *map) {
-    for (u64 i = 0; i < map->cap; ++i) {
-        Ptr bucket_ptr = map->buckets[i];
-        if (is_null_ptr(bucket_ptr) || get_tier(bucket_ptr) != TIER_RAM)
-            continue;
-        if (map->visits[i]) {
-            map->visits[i] = false;
-            continue;
+    if (is_null_ptr(bucket_ptr) && !is_null_ptr(fit_ptr)) {
+        bucket_ptr = fit_ptr;
+        bucket = ta_acquire(map->ta, bucket_ptr);
+    }
+    else if (is_null_ptr(bucket_ptr)) {
+        MemoryTier tier = TIER_RAM;
+        if (existed) {
+            tier = get_tier(map->buckets[i]);
+        }
+        else {
+            sketch_add(map, i);
+            policy_lock(map);
+            tier = admit(map, i) ? TIER_RAM : TIER_CXL;
+            policy_unlock(map);
         }
 
-        map->buckets[i] = ta_migrate(map->ta, bucket_ptr, TIER_CXL);
-        bucket_ptr = map->buckets[i];
-        Bucket *bucket = ta_acquire_raw(map->ta, bucket_ptr);
+        bucket_ptr = ta_create(map->ta, tier);
+        bucket = ta_acquire(map->ta, bucket_ptr);
 
-        while (true) {
-            Ptr next_ptr = bucket->next;
-            if (is_null_ptr(next_ptr))
-                break;
-            Ptr new = ta_migrate(map->ta, next_ptr, TIER_CXL);
-            bucket->next = new;
-            ta_flush(map->ta, bucket_ptr);
-            bucket_ptr = new;
-            bucket = ta_acquire_raw(map->ta, new);
+        bucket_init(map, bucket);
+        if (!existed) {
+            policy_lock(map);
+            if (tier == TIER_RAM) {
+                queue_push(map, &map->ram_queue, i);
+                add_in_ram(map, 1);
+            }
+            else {
+                queue_push(map, &map->cxl_queue, i);
+            }
+            policy_unlock(map);
         }
 
-        ta_flush(map->ta, bucket_ptr);
-        break;
+        bucket->next = map->buckets[i];
+        map->buckets[i] = bucket_ptr;
+
+        ASSERT(entry_size + sizeof(Entry) + 8 <= bucket->space);
     }
 
-    map->in_ram -= 1;
+    entry = bucket_end(bucket);
+    entry->value = 0;
+    update(&entry->value, false, ctx);
+    entry->sentinel = compute_sentinel(hash);
+    entry->size = entry_size;
+    memcpy(entry->key, key, key_size + 1);
+    bucket_push_slot(bucket, entry, compute_tag(hash));
+
+    bucket_set_end(map, bucket, next_entry(entry));
+    add_size(map, 1);
+
+    ta_flush(map->ta, bucket_ptr);
+
+    if (existed)
+        hash_map_touch(map, i);
+    return true;
 }
 
-static void hash_map_check(HashMap *map) {
-    /* u64 count = 0; */
+// Keeps the value an update leaves behind for the log and the front cache
+typedef struct {
+    HashMapUpsertFn update;
+    void *ctx;
+    u64 value;
+} CapturedUpdate;
+
+static void captured_update(u64 *value, bool found, void *ctx) {
+    CapturedUpdate *captured = ctx;
+    captured->update(value, found, captured->ctx);
+    captured->value = *value;
+}
 
-    /* for (u64 i = 0; i < map->cap; ++i) { */
-    /*     Ptr bucket_ptr = map->buckets[i]; */
+// Waits for the records up to lsn when each mutation is to be durable
+static void wal_wait(HashMap *map, u64 lsn) {
+    if (map->wal && map->wal->sync_ms == 0)
+        wal_commit(map->wal, lsn);
+}
 
-    /*     while (!is_null_ptr(bucket_ptr)) { */
-    /*         ASSERT(ta_ptr_valid(map->ta, bucket_ptr)); */
-    /*         Bucket *bucket = ta_acquire_raw(map->ta, bucket_ptr); */
+// Upsert that leaves the commit of its record, whose lsn goes into *lsn, to
+// the caller. The record is appended under the chain latch so that the log
+// has the updates of a key in the order they were applied.
+static bool upsert(
+    HashMap *map, const char *key, HashMapUpsertFn update, void *ctx,
+    u64 *lsn
+) {
+    u32 key_size = strlen(key);
 
-    /*         for (Entry *entry = bucket->data; !is_end(entry); */
-    /*              entry = next_entry(entry)) */
-    /*             count += 1; */
+    u32 hash;
+    MurmurHash3_x86_32(key, key_size, 22, &hash);
 
-    /*         bucket_ptr = bucket->next; */
-    /*     } */
-    /* } */
+    table_read_lock(map);
+    u32 i = bucket_index(map, hash);
+    latch(map, i);
+    MemoryTier tier = get_tier(map->buckets[i]);
+
+    bool inserted;
+    if (map->wal || map->front.sets) {
+        CapturedUpdate captured = {update, ctx, 0};
+        inserted = chain_upsert(
+            map, i, key, key_size, hash, captured_update, &captured
+        );
+        front_put(map, key, key_size, hash, captured.value);
+        if (map->wal) {
+            *lsn =
+                wal_append(map->wal, WAL_PUT, key, key_size, captured.value);
+        }
+    }
+    else {
+        inserted = chain_upsert(map, i, key, key_size, hash, update, ctx);
+    }
 
-    /* ASSERT(count == map->size); */
-    (void) map;
+    OpCounters *ops = op_counters(map, i);
+    stat_add(inserted ? &ops->put_inserts : ops->put_hits + tier, 1);
+    unlatch(map, i);
+
+    hash_map_rebalance(map);
+    bool grow = inserted && should_grow(map);
+    table_unlock(map);
+
+    if (grow)
+        hash_map_grow(map);
+
+    hash_map_check(map);
+    return inserted;
+}
+
+bool hash_map_upsert(
+    HashMap *map, const char *key, HashMapUpsertFn update, void *ctx
+) {
+    u64 lsn = 0;
+    bool inserted = upsert(map, key, update, ctx, &lsn);
+    wal_wait(map, lsn);
+    return inserted;
+}
+
+static void set_value(u64 *value, bool found, void *ctx) {
+    (void) found;
+    *value = *(u64 *) ctx;
 }
 
 bool hash_map_put(HashMap *map, const char *key, u64 value) {
+    return hash_map_upsert(map, key, set_value, &value);
+}
+
+typedef struct {
+    u64 delta;
+    u64 result;
+} AddCtx;
+
+static void add_value(u64 *value, bool found, void *ctx) {
+    AddCtx *add = ctx;
+    (void) found;
+    *value += add->delta;
+    add->result = *value;
+}
+
+u64 hash_map_add(HashMap *map, const char *key, u64 delta) {
+    AddCtx add = {delta, 0};
+    hash_map_upsert(map, key, add_value, &add);
+    return add.result;
+}
+
+bool hash_map_get(HashMap *map, const char *key, u64 *value) {
     u32 key_size = strlen(key);
-    u32 entry_size = key_to_entry_size(key_size);
 
     u32 hash;
     MurmurHash3_x86_32(key, key_size, 22, &hash);
 
-    u32 i = hash % map->cap;
-    Ptr bucket_ptr = map->buckets[i];
-    Bucket *bucket = NULL;
-    MemoryTier tier = TIER_RAM;
+    // Cached keys need neither the table lock nor their chain
+    if (front_get(map, key, key_size, hash, value))
+        return true;
 
-    if (!is_null_ptr(bucket_ptr)) {
-        tier = get_tier(bucket_ptr);
-        if (tier == TIER_RAM)
-            map->visits[i] = true;
-    }
-    else {
-        map->in_ram += 1;
-    }
+    table_read_lock(map);
+    u32 i = bucket_index(map, hash);
+    latch(map, i);
 
+    Ptr bucket_ptr = map->buckets[i];
+    MemoryTier tier = get_tier(bucket_ptr);
     Entry *entry =
         hash_map_find(map, bucket_ptr, key, key_size, hash, &bucket_ptr);
+    OpCounters *ops = op_counters(map, i);
+    stat_add(entry ? ops->get_hits + tier : &ops->get_misses, 1);
     if (entry) {
-        entry->value = value;
-        ta_flush(map->ta, bucket_ptr);
-
-        hash_map_check(map);
-        return false;
+        *value = entry->value;
+        front_put(map, key, key_size, hash, *value);
+        ta_release(map->ta, bucket_ptr);
+        chain_raise(map, i, bucket_ptr, key, key_size, hash);
+        hash_map_touch(map, i);
     }
 
+    unlatch(map, i);
+    if (entry)
+        hash_map_rebalance(map);
+    table_unlock(map);
+
+    hash_map_check(map);
+    return entry != NULL;
+}
+
+// Removal within chain i, whose latch the caller holds
+static bool chain_remove(
+    HashMap *map, u32 i, const char *key, u32 key_size, u32 hash
+) {
+    chain_thaw(map, i);
+    MemoryTier tier = get_tier(map->buckets[i]);
+    Ptr prev_ptr = null_ptr();
+    Ptr bucket_ptr = map->buckets[i];
+    Bucket *bucket = NULL;
+    i32 slot = -1;
+
     while (!is_null_ptr(bucket_ptr)) {
-        bucket = ta_acquire(map->ta, bucket_ptr);
-        if (can_fit(bucket->space, entry_size))
+        bucket = ta_acquire_read(map->ta, bucket_ptr);
+        slot = bucket_probe(bucket, key, key_size, hash);
+        if (slot >= 0)
             break;
+
         Ptr old = bucket_ptr;
+        prev_ptr = bucket_ptr;
         bucket_ptr = bucket->next;
-        ta_flush(map->ta, old);
+        ta_release(map->ta, old);
     }
 
-    if (is_null_ptr(bucket_ptr)) {
-        Ptr new_ptr = ta_create(map->ta, tier);
-        Bucket *new = ta_acquire(map->ta, new_ptr);
+    if (is_null_ptr(bucket_ptr))
+        return false;
 
-        new->data[0].sentinel = SENTINEL_END;
-        new->space = map->ta->chunk_size - offsetof(Bucket, data);
-        new->next = map->buckets[i];
-        map->buckets[i] = new_ptr;
+    bucket = ta_upgrade(map->ta, bucket_ptr);
+    bucket_remove_slot(map, bucket, slot);
+    add_size(map, -1);
 
-        ASSERT(entry_size + sizeof(Entry) + 8 <= new->space);
+    Ptr next_ptr = bucket->next;
 
-        bucket_ptr = new_ptr;
-        bucket = new;
-    }
+    if (bucket->count == 0) {
+        ta_destroy(map->ta, bucket_ptr);
 
-    for (entry = bucket->data; !is_end(entry); entry = next_entry(entry)) {}
+        if (is_null_ptr(prev_ptr)) {
+            map->buckets[i] = next_ptr;
+        }
+        else {
+            Bucket *prev = ta_acquire(map->ta, prev_ptr);
+            prev->next = next_ptr;
+            bucket_merge_next(map, prev);
+            ta_flush(map->ta, prev_ptr);
+        }
 
-    entry->value = value;
-    entry->sentinel = compute_sentinel(hash);
-    entry->size = entry_size;
-    memcpy(entry->key, key, key_size + 1);
+        if (is_null_ptr(map->buckets[i]))
+            chain_emptied(map, i, tier);
 
-    Entry *end = next_entry(entry);
-    ASSERT(in_bucket(bucket, &end->sentinel, map->ta->chunk_size));
-    end->sentinel = SENTINEL_END;
-    map->size += 1;
-    hash_map_check(map);
-    bucket->space = map->ta->chunk_size - ((u64) &end->key - (u64) bucket);
+        return true;
+    }
 
+    bucket_merge_next(map, bucket);
     ta_flush(map->ta, bucket_ptr);
 
-    if (map->in_ram > map->ram_buckets) {
-        hash_map_evict(map);
-        ASSERT(map->in_ram == map->ram_buckets);
+    if (!is_null_ptr(prev_ptr)) {
+        Bucket *prev = ta_acquire(map->ta, prev_ptr);
+        bucket_merge_next(map, prev);
+        ta_flush(map->ta, prev_ptr);
     }
 
-    hash_map_check(map);
     return true;
 }
 
-bool hash_map_get(HashMap *map, const char *key, u64 *value) {
+bool hash_map_remove(HashMap *map, const char *key) {
     u32 key_size = strlen(key);
 
     u32 hash;
     MurmurHash3_x86_32(key, key_size, 22, &hash);
 
-    u32 i = hash % map->cap;
+    table_read_lock(map);
+    u32 i = bucket_index(map, hash);
+    latch(map, i);
+    bool removed = chain_remove(map, i, key, key_size, hash);
+    if (removed)
+        front_remove(map, key, key_size, hash);
+    u64 lsn = 0;
+    if (removed && map->wal)
+        lsn = wal_append(map->wal, WAL_REMOVE, key, key_size, 0);
+    unlatch(map, i);
+    table_unlock(map);
+
+    wal_wait(map, lsn);
+    hash_map_check(map);
+    return removed;
+}
+
+typedef struct {
+    const char *key;
+    u32 key_size;
+    u32 hash;
+    u32 bucket;
+    u32 index;
+    MemoryTier tier;
+    bool done;
+} BatchKey;
+
+static int batch_key_cmp(const void *a, const void *b) {
+    const BatchKey *x = a;
+    const BatchKey *y = b;
+
+    if (x->tier != y->tier)
+        return x->tier < y->tier ? -1 : 1;
+    if (x->bucket != y->bucket)
+        return x->bucket < y->bucket ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// The tiers used for ordering may be stale by the time a group is walked,
+// which only affects the order the groups are served in. SSD chains are
+// prefetched so their reads overlap the walks of the faster groups.
+static BatchKey *batch_prepare(HashMap *map, const char **keys, u32 n) {
+    BatchKey *batch = malloc(n * sizeof(*batch));
+    ASSERT(n == 0 || batch);
+
+    for (u32 k = 0; k < n; ++k) {
+        BatchKey *b = batch + k;
+        b->key = keys[k];
+        b->key_size = strlen(keys[k]);
+        MurmurHash3_x86_32(b->key, b->key_size, 22, &b->hash);
+        b->bucket = bucket_index(map, b->hash);
+        latch(map, b->bucket);
+        b->tier = get_tier(map->buckets[b->bucket]);
+        if (b->tier == TIER_SSD)
+            ta_prefetch(map->ta, map->buckets[b->bucket]);
+        unlatch(map, b->bucket);
+        b->index = k;
+        b->done = false;
+    }
+
+    qsort(batch, n, sizeof(*batch), batch_key_cmp);
+    return batch;
+}
+
+// Walks the chain of group[0].bucket once, borrowing each chunk a single time
+// for the whole group. Without new values matches are copied to out,
+// otherwise the chunk is upgraded and in[index] stored.
+static u32 batch_walk(
+    HashMap *map, BatchKey *group, u32 count, const u64 *in, u64 *out
+) {
+    bool write = in != NULL;
+    u32 hits = 0;
+    u32 i = group[0].bucket;
+
+    latch(map, i);
+    if (write)
+        chain_thaw(map, i);
     Ptr bucket_ptr = map->buckets[i];
+    MemoryTier tier = get_tier(bucket_ptr);
 
-    Entry *entry =
-        hash_map_find(map, bucket_ptr, key, key_size, hash, &bucket_ptr);
-    if (entry) {
-        *value = entry->value;
-        ta_flush(map->ta, bucket_ptr);
-        if (get_tier(bucket_ptr) == TIER_RAM)
-            map->visits[i] = true;
-        hash_map_check(map);
-        return true;
+    while (!is_null_ptr(bucket_ptr) && hits < count) {
+        Bucket *bucket = ta_acquire_read(map->ta, bucket_ptr);
+        bool dirty = false;
+
+        for (u32 k = 0; k < count; ++k) {
+            BatchKey *b = group + k;
+            if (b->done && !write)
+                continue;
+
+            i32 slot = bucket_probe(bucket, b->key, b->key_size, b->hash);
+            if (slot < 0)
+                continue;
+
+            if (!b->done)
+                hits += 1;
+            b->done = true;
+
+            if (!write) {
+                out[b->index] = bucket_entry(bucket, slot)->value;
+                continue;
+            }
+
+            if (!dirty) {
+                bucket = ta_upgrade(map->ta, bucket_ptr);
+                dirty = true;
+            }
+            bucket_entry(bucket, slot)->value = in[b->index];
+            front_put(map, b->key, b->key_size, b->hash, in[b->index]);
+            if (map->wal) {
+                wal_append(
+                    map->wal, WAL_PUT, b->key, b->key_size, in[b->index]
+                );
+            }
+        }
+
+        Ptr old = bucket_ptr;
+        bucket_ptr = bucket->next;
+        if (dirty)
+            ta_flush(map->ta, old);
+        else
+            ta_release(map->ta, old);
+    }
+
+    OpCounters *ops = op_counters(map, i);
+    if (write) {
+        stat_add(ops->put_hits + tier, hits);
+    }
+    else {
+        stat_add(ops->get_hits + tier, hits);
+        stat_add(&ops->get_misses, count - hits);
+    }
+
+    if (hits > 0)
+        hash_map_touch(map, i);
+    unlatch(map, i);
+    return hits;
+}
+
+static u32 group_length(BatchKey *batch, u32 k, u32 n) {
+    u32 end = k + 1;
+    while (end < n && batch[end].bucket == batch[k].bucket)
+        end += 1;
+    return end - k;
+}
+
+u32 hash_map_get_many(
+    HashMap *map, const char **keys, u32 n, u64 *values, bool *found
+) {
+    table_read_lock(map);
+    BatchKey *batch = batch_prepare(map, keys, n);
+    u32 hits = 0;
+
+    for (u32 k = 0; k < n;) {
+        u32 count = group_length(batch, k, n);
+        hits += batch_walk(map, batch + k, count, NULL, values);
+        k += count;
+    }
+
+    hash_map_rebalance(map);
+    table_unlock(map);
+
+    if (found) {
+        for (u32 k = 0; k < n; ++k)
+            found[batch[k].index] = batch[k].done;
+    }
+
+    free(batch);
+    hash_map_check(map);
+    return hits;
+}
+
+u32 hash_map_put_many(
+    HashMap *map, const char **keys, const u64 *values, u32 n
+) {
+    table_read_lock(map);
+    BatchKey *batch = batch_prepare(map, keys, n);
+    u32 inserted = 0;
+
+    for (u32 k = 0; k < n;) {
+        u32 count = group_length(batch, k, n);
+        batch_walk(map, batch + k, count, values, NULL);
+        k += count;
     }
 
+    hash_map_rebalance(map);
+    table_unlock(map);
+
+    // Misses need chunk space and may grow the table, so they go through the
+    // regular insert path once every chain has been updated. The whole batch
+    // is committed at once.
+    u64 lsn = 0;
+    for (u32 k = 0; k < n; ++k) {
+        BatchKey *b = batch + k;
+        u64 value = values[b->index];
+        if (!b->done)
+            inserted += upsert(map, b->key, set_value, &value, &lsn);
+    }
+
+    if (map->wal)
+        wal_wait(map, wal_last_lsn(map->wal));
+    free(batch);
     hash_map_check(map);
-    return false;
+    return inserted;
 }
 
 void hash_map_iter(HashMapIter *iter, HashMap *map) {
     iter->map = map;
     iter->i = 0;
     iter->bucket_ptr = null_ptr();
-    iter->entry = NULL;
+    iter->bucket = NULL;
+    iter->slot = 0;
 }
 
+// Walks every chunk of every chain in turn, chain i being the next to start
 Entry *hash_map_iter_next(HashMapIter *iter) {
-    for (; iter->i < iter->map->cap; ++iter->i) {
-        if (is_null_ptr(iter->map->buckets[iter->i]))
-            continue;
-
-        if (iter->entry == NULL) {
-            if (!is_null_ptr(iter->bucket_ptr))
-                ta_flush(iter->map->ta, iter->bucket_ptr);
+    HashMap *map = iter->map;
 
-            Bucket *bucket =
-                ta_acquire(iter->map->ta, iter->map->buckets[iter->i]);
+    while (true) {
+        if (iter->bucket && iter->slot < iter->bucket->count)
+            return bucket_entry(iter->bucket, iter->slot++);
 
-            iter->bucket_ptr = iter->map->buckets[iter->i];
-            iter->entry = bucket->data;
+        Ptr next_ptr = null_ptr();
+        if (iter->bucket) {
+            next_ptr = iter->bucket->next;
+            ta_release(map->ta, iter->bucket_ptr);
+            iter->bucket = NULL;
         }
 
-        Entry *entry = iter->entry;
-        iter->entry = next_entry(entry);
+        if (is_null_ptr(next_ptr)) {
+            while (iter->i < map->cap && is_null_ptr(map->buckets[iter->i]))
+                iter->i += 1;
 
-        if (is_end(iter->entry)) {
-            iter->entry = NULL;
+            if (iter->i == map->cap) {
+                iter->bucket_ptr = null_ptr();
+                return NULL;
+            }
+
+            next_ptr = map->buckets[iter->i];
             iter->i += 1;
         }
 
-        return entry;
+        iter->bucket_ptr = next_ptr;
+        iter->bucket = ta_acquire_read(map->ta, next_ptr);
+        iter->slot = 0;
     }
-
-    if (!is_null_ptr(iter->bucket_ptr))
-        ta_flush(iter->map->ta, iter->bucket_ptr);
-
-    return NULL;
 }
 
 void hash_map_debug(HashMap *map, FILE *file) {
     u64 count = 0;
 
+    table_read_lock(map);
+
     for (u64 i = 0; i < map->cap; ++i) {
+        latch(map, i);
         Ptr bucket_ptr = map->buckets[i];
 
         while (!is_null_ptr(bucket_ptr)) {
-            Bucket *bucket = ta_acquire(map->ta, bucket_ptr);
+            Bucket *bucket = ta_acquire_read(map->ta, bucket_ptr);
 
-            for (Entry *entry = bucket->data; !is_end(entry);
+            for (Entry *entry = bucket_data(bucket); !is_end(entry);
                  entry = next_entry(entry)) {
                 count += 1;
                 fprintf(file, "%s -> %lu\n", entry->key, entry->value);
@@ -317,16 +2322,97 @@ void hash_map_debug(HashMap *map, FILE *file) {
 
             Ptr old = bucket_ptr;
             bucket_ptr = bucket->next;
-            ta_flush(map->ta, old);
+            ta_release(map->ta, old);
         }
+
+        unlatch(map, i);
     }
 
-    ASSERT(count == map->size);
+    table_unlock(map);
+    ASSERT(map->concurrent || count == map->size);
 }
 
 u64 hash_map_mem_usage(HashMap *map) {
-    u64 total = map->cap * (sizeof(*map->buckets) + sizeof(*map->visits));
+    u64 total = map->alloc * (sizeof(*map->buckets) + sizeof(*map->visits) +
+                            sizeof(*map->heat) + sizeof(*map->deep_hits) +
+                            sizeof(*map->deep_tags) +
+                            sizeof(*map->newer) +
+                            sizeof(*map->older));
+    total += (map->latch_mask + 1) * sizeof(*map->ops);
+    if (map->front.sets)
+        total += sizeof(FrontSet) << map->front.set_bits;
     for (u8 t = 0; t < NUM_TIERS; ++t)
-        total += map->ta->memory_usage[t];
+        total += ta_memory_usage(map->ta, t);
     return total;
 }
+
+void hash_map_stats(HashMap *map, HashMapStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    table_read_lock(map);
+
+    for (u32 k = 0; k <= map->latch_mask; ++k) {
+        OpCounters *ops = map->ops + k;
+        for (u32 t = 0; t < NUM_TIERS; ++t) {
+            stats->get_hits[t] +=
+                __atomic_load_n(ops->get_hits + t, __ATOMIC_RELAXED);
+            stats->put_hits[t] +=
+                __atomic_load_n(ops->put_hits + t, __ATOMIC_RELAXED);
+        }
+        stats->get_misses +=
+            __atomic_load_n(&ops->get_misses, __ATOMIC_RELAXED);
+        stats->put_inserts +=
+            __atomic_load_n(&ops->put_inserts, __ATOMIC_RELAXED);
+    }
+
+    stats->front_hits = __atomic_load_n(&map->front.hits, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&map->evictions, __ATOMIC_RELAXED);
+    stats->demotions = __atomic_load_n(&map->demotions, __ATOMIC_RELAXED);
+    stats->promotions = __atomic_load_n(&map->promotions, __ATOMIC_RELAXED);
+    stats->admitted =
+        __atomic_load_n(&map->sketch.admitted, __ATOMIC_RELAXED);
+    stats->rejected =
+        __atomic_load_n(&map->sketch.rejected, __ATOMIC_RELAXED);
+    stats->merges = __atomic_load_n(&map->merges, __ATOMIC_RELAXED);
+    stats->raises = __atomic_load_n(&map->raises, __ATOMIC_RELAXED);
+    stats->size = __atomic_load_n(&map->size, __ATOMIC_RELAXED);
+    stats->cap = map->cap;
+    stats->in_ram = __atomic_load_n(&map->in_ram, __ATOMIC_RELAXED);
+    stats->ram_buckets =
+        __atomic_load_n(&map->ram_buckets, __ATOMIC_RELAXED);
+    table_unlock(map);
+
+    ta_stats(map->ta, &stats->ta);
+}
+
+void hash_map_shape(HashMap *map, HashMapShape *shape) {
+    memset(shape, 0, sizeof(*shape));
+    u64 room = map->ta->chunk_size - bucket_data_offset(map->ta->chunk_size);
+
+    table_read_lock(map);
+
+    for (u64 i = 0; i < map->cap; ++i) {
+        latch(map, i);
+        Ptr bucket_ptr = map->buckets[i];
+        u32 length = 0;
+
+        while (!is_null_ptr(bucket_ptr)) {
+            Bucket *bucket = ta_acquire_read(map->ta, bucket_ptr);
+            u64 fill = bucket_used(bucket) * CHUNK_FILL_BUCKETS / room;
+            if (fill >= CHUNK_FILL_BUCKETS)
+                fill = CHUNK_FILL_BUCKETS - 1;
+            shape->chunk_fill[fill] += 1;
+            length += 1;
+
+            Ptr old = bucket_ptr;
+            bucket_ptr = bucket->next;
+            ta_release(map->ta, old);
+        }
+
+        unlatch(map, i);
+        if (length >= CHAIN_LENGTH_BUCKETS)
+            length = CHAIN_LENGTH_BUCKETS - 1;
+        shape->chain_lengths[length] += 1;
+    }
+
+    table_unlock(map);
+}
@@ -1,9 +1,11 @@
 #ifndef HASH_MAP_H_
 #define HASH_MAP_H_
 
+#include <pthread.h>
 #include <stdio.h>
 
 #include "memory.h"
+#include "wal.h"
 
 typedef struct {
     u64 value;
@@ -12,35 +14,300 @@ typedef struct {
     char key[];
 } Entry;
 
+// The header is followed by `slots` tags, the k-th holding the top hash byte
+// of the k-th entry, then as many u16 offsets giving where each entry starts
+// in the data, in 8 byte units. The slot count follows from the chunk size.
 typedef struct {
     Ptr next;
     u32 space;
-    Entry data[];
+    u16 count;
+    u16 slots;
+    u8 tags[];
 } Bucket;
 
+// Intrusive list of bucket indices, newest at the head
+typedef struct {
+    u32 head;
+    u32 tail;
+} BucketQueue;
+
+#define FRONT_WAYS 8
+#define FRONT_KEY_MAX 23
+
+// One set of the front cache. lens[w] is the key length plus one, 0 while
+// way w is free, and refs has a bit per way for the clock.
+typedef struct {
+    u32 hashes[FRONT_WAYS];
+    u8 lens[FRONT_WAYS];
+    u8 refs;
+    u8 hand;
+    u64 values[FRONT_WAYS];
+    char keys[FRONT_WAYS][FRONT_KEY_MAX];
+} FrontSet;
+
+typedef struct {
+    u32 set_bits;
+    FrontSet *sets;
+    pthread_mutex_t *locks;
+    u64 hits;
+    u64 misses;
+} FrontCache;
+
+#define SKETCH_DEPTH 4
+
+// Count-min sketch of chain accesses with counters saturating at 15. Every
+// counter is halved once the sketch has taken 10 increments per column.
+typedef struct {
+    u8 *counters;
+    u32 width_bits;
+    u32 ticks;
+    u64 admitted;
+    u64 rejected;
+} FreqSketch;
+
+// Operation counters of one latch stripe, written under its latch. A stripe
+// fills one cache line so that threads on different stripes do not share it.
+typedef struct {
+    u64 get_hits[NUM_TIERS];
+    u64 get_misses;
+    u64 put_hits[NUM_TIERS];
+    u64 put_inserts;
+} OpCounters;
+
+// RAM budget controller. The acquire samples of the allocator seen at the
+// last step are kept to measure the next window.
+typedef struct {
+    bool enabled;
+    u64 max_bytes;
+    u32 latency_ns;
+    u32 pressure_limit;
+    u32 low_share;
+    u32 ticks;
+    u64 last_ns;
+    u64 samples[NUM_TIERS];
+    u64 sample_ns[NUM_TIERS];
+    u64 grows;
+    u64 shrinks;
+} RamControl;
+
 typedef struct {
     TieredAllocator *ta;
     Ptr *buckets;
     bool *visits;
+    u8 *heat;
+    u8 *deep_hits;
+    u8 *deep_tags;
+    u32 *newer;
+    u32 *older;
+    BucketQueue ram_queue;
+    BucketQueue cxl_queue;
     u32 hand;
     u32 size;
     u32 cap;
+    u32 alloc;
+    u32 base_cap;
+    u32 level;
+    u32 split;
+    u32 max_load;
     u32 in_ram;
     u32 ram_buckets;
+    u32 ram_low;
+    u32 cold_hits;
+    u8 promote_threshold;
+    u8 raise_period;
+    u64 raises;
+    u64 cxl_budget;
+
+    bool concurrent;
+    u32 latch_mask;
+    pthread_mutex_t *latches;
+    pthread_mutex_t policy_lock;
+    pthread_rwlock_t table_lock;
+
+    bool maintenance;
+    bool maint_stop;
+    bool maint_pending;
+    u32 maint_period_ms;
+    u32 compact_cursor;
+    u64 merges;
+    u64 evictions;
+    u64 demotions;
+    u64 promotions;
+    OpCounters *ops;
+    pthread_t maint_thread;
+    pthread_mutex_t maint_lock;
+    pthread_cond_t maint_cond;
+
+    Wal *wal;
+    u64 wal_lsn;
+    u64 *pinned;
+    Ptr *retired;
+    u64 num_retired;
+    u64 retired_cap;
+    pthread_mutex_t retire_lock;
+
+    FrontCache front;
+    FreqSketch sketch;
+    RamControl control;
 } HashMap;
 
+// Counters since the map was created. Hits are by the tier the chain was in,
+// and gets answered by the front cache only count as front_hits. Puts count
+// every write of a key by a put, add, upsert or batch.
+typedef struct {
+    u64 get_hits[NUM_TIERS];
+    u64 get_misses;
+    u64 front_hits;
+    u64 put_hits[NUM_TIERS];
+    u64 put_inserts;
+    u64 evictions;
+    u64 demotions;
+    u64 promotions;
+    u64 admitted;
+    u64 rejected;
+    u64 merges;
+    u64 raises;
+    u64 size;
+    u64 cap;
+    u64 in_ram;
+    u64 ram_buckets;
+    TaStats ta;
+} HashMapStats;
+
+#define CHAIN_LENGTH_BUCKETS 16
+#define CHUNK_FILL_BUCKETS 10
+
+// Chains by their number of chunks, the last bucket taking every longer one,
+// and chunks by the share of their entry space in use, in tenths
+typedef struct {
+    u64 chain_lengths[CHAIN_LENGTH_BUCKETS];
+    u64 chunk_fill[CHUNK_FILL_BUCKETS];
+} HashMapShape;
+
+// Called with found = false and *value = 0 when the key is being inserted
+typedef void (*HashMapUpsertFn)(u64 *value, bool found, void *ctx);
+
+// Holds a read borrow on the chunk of the last entry returned
 typedef struct {
     HashMap *map;
     u64 i;
     Ptr bucket_ptr;
-    Entry *entry;
+    Bucket *bucket;
+    u32 slot;
 } HashMapIter;
 
 void hash_map_init(HashMap *map, TieredAllocator *ta, u32 cap, u32 ram_buckets);
 void hash_map_deinit(HashMap *map);
 
+// Makes get/put/add/upsert/remove and the batched calls safe to use from many
+// threads. Chains are latched in `stripes` stripes (a power of two), SIEVE and
+// LRU state sit behind one policy lock, and table growth excludes every other
+// operation. Must be called before the map is shared. Iteration is not
+// covered and needs the map to be quiescent.
+void hash_map_set_concurrent(HashMap *map, u32 stripes);
+
+// Starts a worker that evicts, demotes and compacts off the foreground path.
+// It is woken once RAM or CXL goes over budget and then brings in_ram down to
+// ram_low, and every period_ms it also merges neighbouring chunks of a slice
+// of the chains. Operations only do that work themselves while more than an
+// eighth over budget. Needs hash_map_set_concurrent, and both calls need the
+// map to be otherwise idle.
+void hash_map_start_maintenance(HashMap *map, u32 period_ms);
+void hash_map_stop_maintenance(HashMap *map);
+
+// Checkpoints the map and frees it like hash_map_deinit but keeps its
+// chunks. The allocator should then be deinitialized. The map must be
+// otherwise idle.
+void hash_map_close(HashMap *map);
+// Reattaches to the table saved by the last checkpoint in the file ta was
+// opened from. Nothing is read up front: chains are faulted in from SSD as
+// they are used, and those that were in RAM then are promoted by their first
+// hit. Returns false when ta holds no saved table.
+bool hash_map_open(HashMap *map, TieredAllocator *ta, u32 ram_buckets);
+
+// Logs puts, adds, upserts and removes to the file at path, first replaying
+// the records it holds that are newer than the map. With sync_ms 0 each
+// mutation returns once its record is on disk, and concurrent mutations
+// share one fdatasync. Otherwise the log is synced every sync_ms and a crash
+// may lose that much. Maps without a log stay fast and volatile. Must be
+// called before the map is shared.
+void hash_map_enable_wal(HashMap *map, const char *path, u32 sync_ms);
+// Saves the table in the backing file of the allocator, along with the lsn
+// of the last record it includes, and then empties the log. Chains on SSD
+// are saved as they are and copied by their next write, others as SSD
+// copies, so the saved table stays intact until the next checkpoint. The map
+// must be otherwise idle.
+void hash_map_checkpoint(HashMap *map);
+
+// Caches the values of up to `entries` keys (rounded up to a power of two
+// number of sets) of at most FRONT_KEY_MAX bytes in front of the chains, so
+// hot keys are read without touching their chunks wherever those live.
+// Writes go through to the chain, and 0 disables the cache. Must be called
+// before the map is shared.
+void hash_map_set_front_cache(HashMap *map, u32 entries);
+
+// Admission filter for RAM (TinyLFU). Chain accesses are counted in a sketch
+// of `width` counters per row (rounded up to a power of two), and once RAM
+// is full a chain that is promoted or created only takes a RAM slot when it
+// has been used more often than the chain SIEVE would evict for it. New
+// chains that are turned away start in CXL. 0 disables the filter. Must be
+// called before the map is shared.
+void hash_map_set_admission(HashMap *map, u32 width);
+
+// Lets a controller move ram_buckets, and ram_low in proportion, every 100ms
+// or so from the maintenance worker, or from operations when there is none.
+// RAM is cut by about an eighth while RAM and CXL together hold more than
+// max_bytes. Otherwise it grows by about a sixteenth while there is room
+// under max_bytes, chains are being fetched from the cold tiers and the
+// sampled mean acquire latency is at least latency_ns, and it shrinks by as
+// much once that mean is under half of latency_ns. Either goal may be 0 to
+// leave it out, but not both; without latency_ns RAM grows whenever there is
+// room. The budget stays between 1 and the number of buckets. Must be called
+// before the map is shared.
+void hash_map_set_ram_target(HashMap *map, u64 max_bytes, u32 latency_ns);
+// Also cuts RAM while the "some avg10" memory pressure of the system
+// (/proc/pressure/memory) is above `limit` hundredths of a percent, 0
+// ignores pressure. With no RAM target set, the budget is only ever cut.
+void hash_map_set_pressure_limit(HashMap *map, u32 limit);
+
+// Once more than ram_buckets chains are in RAM, evict down to ram_low
+void hash_map_set_low_watermark(HashMap *map, u32 ram_low);
+// A cold chain hit this many times (with periodic aging) moves back to RAM,
+// 0 disables promotion
+void hash_map_set_promotion(HashMap *map, u8 threshold);
+// An entry behind the first chunk of its chain moves to the first chunk once
+// its hits there outnumber those on the chain's other deep entries by
+// period, so hot entries collect where a lookup finds them first. 0 keeps
+// entries where they were inserted.
+void hash_map_set_raise_period(HashMap *map, u8 period);
+// Least recently used CXL chains are demoted to SSD while the compressed tier
+// holds more than this many bytes
+void hash_map_set_cxl_budget(HashMap *map, u64 bytes);
+// Grows the table one bucket split at a time (linear hashing) while there are
+// more than max_load / 100 entries per bucket, 0 keeps cap fixed
+void hash_map_set_max_load(HashMap *map, u32 max_load);
+
 bool hash_map_put(HashMap *map, const char *key, u64 value);
 bool hash_map_get(HashMap *map, const char *key, u64 *value);
+bool hash_map_remove(HashMap *map, const char *key);
+
+// Find-or-insert in a single pass over the chain, returns true on insert
+bool hash_map_upsert(
+    HashMap *map, const char *key, HashMapUpsertFn update, void *ctx
+);
+// Adds delta to the value of key (0 when absent) and returns the sum
+u64 hash_map_add(HashMap *map, const char *key, u64 delta);
+
+// Batched variants: keys are grouped by chain, coldest tier last, so that each
+// chunk is borrowed once per batch. get_many fills values[k] and found[k]
+// (which may be NULL) and returns the number of hits, put_many returns the
+// number of inserts. Later duplicates in a put batch win.
+u32 hash_map_get_many(
+    HashMap *map, const char **keys, u32 n, u64 *values, bool *found
+);
+u32 hash_map_put_many(
+    HashMap *map, const char **keys, const u64 *values, u32 n
+);
 
 void hash_map_iter(HashMapIter *iter, HashMap *map);
 Entry *hash_map_iter_next(HashMapIter *iter);
@@ -48,4 +315,10 @@ Entry *hash_map_iter_next(HashMapIter *iter);
 void hash_map_debug(HashMap *map, FILE *file);
 u64 hash_map_mem_usage(HashMap *map);
 
+// Sums the counters of every latch stripe and of the allocator. Nothing but
+// the table lock is taken, so this may run alongside other operations.
+void hash_map_stats(HashMap *map, HashMapStats *stats);
+// Reads every chunk of every chain, one chain latch at a time
+void hash_map_shape(HashMap *map, HashMapShape *shape);
+
 #endif // HASH_MAP_H_
@@ -1,9 +1,13 @@
 #include <stdint.h>
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "hash_map.h"
@@ -37,11 +41,9 @@ static u64 count_words(HashMap *counter, char *text) {
             u64 len = i - word_start;
             if (len > 0) {
                 text[i] = 0;
-                u64 count = 0;
 
                 bytes_in += len + 9;
-                hash_map_get(counter, text + word_start, &count);
-                hash_map_put(counter, text + word_start, count + 1);
+                hash_map_add(counter, text + word_start, 1);
             }
 
             word_start = i + 1;
@@ -71,6 +73,164 @@ char *read_file(const char *path) {
 
 #define NEXT_ARG(arr, n) (n == 0 ? abort() : 0, n--, *arr++)
 
+static double ratio(u64 a, u64 b) {
+    return b ? (double) a / (double) b : 0;
+}
+
+static void write_hist_text(
+    FILE *file, const char *name, const u64 *hist, u32 n, bool log2
+) {
+    fprintf(file, "  %s", name);
+    for (u32 b = 0; b < n; ++b) {
+        if (hist[b] == 0)
+            continue;
+        if (log2)
+            fprintf(file, " 2^%u:%lu", b, hist[b]);
+        else
+            fprintf(file, " %u:%lu", b, hist[b]);
+    }
+    fprintf(file, "\n");
+}
+
+static void write_hist_json(
+    FILE *file, const char *name, const u64 *hist, u32 n, const char *end
+) {
+    fprintf(file, "\"%s\": [", name);
+    for (u32 b = 0; b < n; ++b)
+        fprintf(file, "%s%lu", b ? ", " : "", hist[b]);
+    fprintf(file, "]%s", end);
+}
+
+// Writes the counters of the map and its allocator, and the shape of its
+// chains, as text or as one JSON object. Hit rates are shares of every get or
+// put that found its key.
+static void write_stats(HashMap *map, FILE *file, bool json) {
+    HashMapStats stats;
+    HashMapShape shape;
+    hash_map_stats(map, &stats);
+    hash_map_shape(map, &shape);
+    TaStats *ta = &stats.ta;
+
+    u64 gets = stats.front_hits + stats.get_misses;
+    u64 puts = stats.put_inserts;
+    for (u32 t = 0; t < NUM_TIERS; ++t) {
+        gets += stats.get_hits[t];
+        puts += stats.put_hits[t];
+    }
+
+    if (!json) {
+        fprintf(
+            file, "map size %lu cap %lu in_ram %lu ram_buckets %lu\n",
+            stats.size, stats.cap, stats.in_ram, stats.ram_buckets
+        );
+        fprintf(
+            file, "gets %lu front %.4f miss %.4f, puts %lu insert %.4f\n",
+            gets, ratio(stats.front_hits, gets),
+            ratio(stats.get_misses, gets), puts,
+            ratio(stats.put_inserts, puts)
+        );
+        fprintf(
+            file,
+            "evictions %lu demotions %lu promotions %lu admitted %lu "
+            "rejected %lu merges %lu raises %lu\n",
+            stats.evictions, stats.demotions, stats.promotions,
+            stats.admitted, stats.rejected, stats.merges, stats.raises
+        );
+        fprintf(
+            file, "compressed %lu -> %lu (ratio %.3f) decompressed %lu\n",
+            ta->compressed_in, ta->compressed_out,
+            ratio(ta->compressed_in, ta->compressed_out), ta->decompressed
+        );
+
+        for (u32 t = 0; t < NUM_TIERS; ++t) {
+            TierStats *tier = ta->tiers + t;
+            fprintf(
+                file,
+                "%s get %.4f put %.4f acquires %lu flushes %lu "
+                "migrations %lu\n",
+                TIER_STRS[t], ratio(stats.get_hits[t], gets),
+                ratio(stats.put_hits[t], puts), tier->acquires,
+                tier->flushes, tier->migrations
+            );
+            write_hist_text(
+                file, "acquire_ns", tier->acquire_hist, LATENCY_BUCKETS, true
+            );
+            write_hist_text(
+                file, "flush_ns", tier->flush_hist, LATENCY_BUCKETS, true
+            );
+        }
+
+        fprintf(file, "shape\n");
+        write_hist_text(
+            file, "chain_chunks", shape.chain_lengths, CHAIN_LENGTH_BUCKETS,
+            false
+        );
+        write_hist_text(
+            file, "chunk_fill_tenths", shape.chunk_fill, CHUNK_FILL_BUCKETS,
+            false
+        );
+        return;
+    }
+
+    fprintf(
+        file,
+        "{\"size\": %lu, \"cap\": %lu, \"in_ram\": %lu, "
+        "\"ram_buckets\": %lu, ",
+        stats.size, stats.cap, stats.in_ram, stats.ram_buckets
+    );
+    fprintf(
+        file,
+        "\"gets\": %lu, \"front_hits\": %lu, \"get_misses\": %lu, "
+        "\"puts\": %lu, \"put_inserts\": %lu, ",
+        gets, stats.front_hits, stats.get_misses, puts, stats.put_inserts
+    );
+    fprintf(
+        file,
+        "\"evictions\": %lu, \"demotions\": %lu, \"promotions\": %lu, "
+        "\"admitted\": %lu, \"rejected\": %lu, \"merges\": %lu, "
+        "\"raises\": %lu, ",
+        stats.evictions, stats.demotions, stats.promotions, stats.admitted,
+        stats.rejected, stats.merges, stats.raises
+    );
+    fprintf(
+        file,
+        "\"compressed_in\": %lu, \"compressed_out\": %lu, "
+        "\"compression_ratio\": %.4f, \"decompressed\": %lu, ",
+        ta->compressed_in, ta->compressed_out,
+        ratio(ta->compressed_in, ta->compressed_out), ta->decompressed
+    );
+
+    fprintf(file, "\"tiers\": {");
+    for (u32 t = 0; t < NUM_TIERS; ++t) {
+        TierStats *tier = ta->tiers + t;
+        fprintf(
+            file,
+            "\"%s\": {\"get_hits\": %lu, \"get_hit_rate\": %.4f, "
+            "\"put_hits\": %lu, \"put_hit_rate\": %.4f, "
+            "\"acquires\": %lu, \"flushes\": %lu, \"migrations\": %lu, ",
+            TIER_STRS[t], stats.get_hits[t], ratio(stats.get_hits[t], gets),
+            stats.put_hits[t], ratio(stats.put_hits[t], puts),
+            tier->acquires, tier->flushes, tier->migrations
+        );
+        write_hist_json(
+            file, "acquire_ns_log2", tier->acquire_hist, LATENCY_BUCKETS, ", "
+        );
+        write_hist_json(
+            file, "flush_ns_log2", tier->flush_hist, LATENCY_BUCKETS,
+            t + 1 < NUM_TIERS ? "}, " : "}"
+        );
+    }
+    fprintf(file, "}, ");
+
+    write_hist_json(
+        file, "chain_chunks", shape.chain_lengths, CHAIN_LENGTH_BUCKETS, ", "
+    );
+    write_hist_json(
+        file, "chunk_fill_tenths", shape.chunk_fill, CHUNK_FILL_BUCKETS,
+        "}\n"
+    );
+}
+
 void placement(int argc, char **argv) {
     TieredAllocator ta;
     ta_init(&ta, 256, 1 << 16);
@@ -82,6 +242,12 @@ void placement(int argc, char **argv) {
     HashMap counter;
     hash_map_init(&counter, &ta, buckets, ram_buckets);
 
+    if (argc > 0)
+        hash_map_set_cxl_budget(&counter, atoll(NEXT_ARG(argv, argc)) * 1024);
+
+    // Statistics go to data/stats.txt or data/stats.json
+    const char *stats_format = argc > 0 ? NEXT_ARG(argv, argc) : NULL;
+
     char *text = read_file("data/sample.txt");
     Timer timer;
     timer_start(&timer);
@@ -99,6 +265,14 @@ void placement(int argc, char **argv) {
     hash_map_debug(&counter, file);
     ASSERT(fclose(file) == 0);
 
+    if (stats_format) {
+        bool json = strcmp(stats_format, "json") == 0;
+        file = fopen(json ? "data/stats.json" : "data/stats.txt", "w");
+        ASSERT(file);
+        write_stats(&counter, file, json);
+        ASSERT(fclose(file) == 0);
+    }
+
     free(text);
     hash_map_deinit(&counter);
     ta_deinit(&ta);
@@ -112,6 +286,9 @@ void memory(int argc, char **argv) {
 
     int iters = atoi(NEXT_ARG(argv, argc));
 
+    if (argc > 0 && strcmp(NEXT_ARG(argv, argc), "pio") == 0)
+        ta_set_ssd_backend(&ta, SSD_PIO);
+
     for (int t = 0; t < NUM_TIERS; ++t) {
         Ptr *ptrs = malloc(iters * sizeof(*ptrs));
         for (int i = 0; i < iters; ++i)
@@ -138,8 +315,605 @@ void memory(int argc, char **argv) {
         for (int i = 0; i < iters; ++i)
             ta_destroy(&ta, ptrs[i]);
         free(ptrs);
+        ta_sync(&ta);
+    }
+
+    ta_deinit(&ta);
+}
+
+// Copies the next part of text, which ends at the first non-letter at least
+// len bytes on so that no word is cut
+static char *text_part(const char *text, u64 *pos, u64 len) {
+    u64 start = *pos;
+    u64 end = start;
+    while (text[end] && (end < start + len || isalpha(text[end])))
+        end += 1;
+    if (text[end])
+        end += 1;
+
+    *pos = end;
+    char *part = strndup(text + start, end - start);
+    ASSERT(part);
+    return part;
+}
+
+#define RECOVERY_SSD_PATH "data/recovery.ssd"
+#define RECOVERY_WAL_PATH "data/recovery.wal"
+#define RECOVERY_SYNC_MS 100
+
+// Puts or removes the keys prefix0 to prefix99, none of which is a word
+static void recovery_keys(HashMap *map, const char *prefix, bool put) {
+    char key[32];
+    for (u32 k = 0; k < 100; ++k) {
+        snprintf(key, sizeof(key), "%s%u", prefix, k);
+        if (put)
+            hash_map_put(map, key, k);
+        else
+            ASSERT(hash_map_remove(map, key));
+    }
+}
+
+static void recovery_open(
+    TieredAllocator *ta, HashMap *map, u32 ram_buckets, bool pio
+) {
+    ASSERT(ta_open(ta, RECOVERY_SSD_PATH));
+    if (pio)
+        ta_set_ssd_backend(ta, SSD_PIO);
+    ASSERT(hash_map_open(map, ta, ram_buckets));
+    hash_map_enable_wal(map, RECOVERY_WAL_PATH, RECOVERY_SYNC_MS);
+}
+
+// Waits for a child that dies without closing its map once what it did is
+// logged
+static void recovery_crash(pid_t pid, HashMap *map) {
+    ASSERT(pid != -1);
+    if (pid == 0) {
+        wal_commit(map->wal, wal_last_lsn(map->wal));
+        _exit(0);
+    }
+
+    int status;
+    ASSERT(waitpid(pid, &status, 0) == pid);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Counts the words of data/sample.txt in a logged map that crashes twice
+// and is closed once, leaving the table it ends with in data/debug.txt for
+// test.py
+void recovery(int argc, char **argv) {
+    int buckets = atoi(NEXT_ARG(argv, argc));
+    int ram_bucket_percent = atoi(NEXT_ARG(argv, argc));
+    int ram_buckets = buckets * ram_bucket_percent / 100;
+    bool pio = argc > 0 && strcmp(NEXT_ARG(argv, argc), "pio") == 0;
+
+    char *text = read_file("data/sample.txt");
+    u64 third = strlen(text) / 3;
+    u64 pos = 0;
+    char *parts[3];
+    for (u32 k = 0; k < 3; ++k)
+        parts[k] = text_part(text, &pos, k < 2 ? third : strlen(text));
+
+    unlink(RECOVERY_SSD_PATH);
+    unlink(RECOVERY_WAL_PATH);
+
+    TieredAllocator ta;
+    HashMap map;
+
+    // The first third is checkpointed and the second only logged, with keys
+    // put and removed on both sides of the checkpoint
+    pid_t pid = fork();
+    if (pid == 0) {
+        ta_init_at(&ta, RECOVERY_SSD_PATH, 256, 1 << 16);
+        if (pio)
+            ta_set_ssd_backend(&ta, SSD_PIO);
+        hash_map_init(&map, &ta, buckets, ram_buckets);
+        hash_map_enable_wal(&map, RECOVERY_WAL_PATH, RECOVERY_SYNC_MS);
+
+        count_words(&map, parts[0]);
+        recovery_keys(&map, "a", true);
+        recovery_keys(&map, "b", true);
+        recovery_keys(&map, "b", false);
+        hash_map_checkpoint(&map);
+
+        recovery_keys(&map, "a", false);
+        recovery_keys(&map, "c", true);
+        count_words(&map, parts[1]);
+        recovery_keys(&map, "c", false);
+    }
+    recovery_crash(pid, &map);
+
+    // The log is replayed over the saved table, which is checkpointed again
+    // and then written to through the chains it shares with the live map
+    pid = fork();
+    if (pid == 0) {
+        recovery_open(&ta, &map, ram_buckets, pio);
+        hash_map_checkpoint(&map);
+        count_words(&map, parts[2]);
+    }
+    recovery_crash(pid, &map);
+
+    recovery_open(&ta, &map, ram_buckets, pio);
+    hash_map_close(&map);
+    ta_deinit(&ta);
+
+    recovery_open(&ta, &map, ram_buckets, pio);
+    FILE *file = fopen("data/debug.txt", "w");
+    ASSERT(file);
+    hash_map_debug(&map, file);
+    ASSERT(fclose(file) == 0);
+
+    hash_map_deinit(&map);
+    ta_deinit(&ta);
+    unlink(RECOVERY_SSD_PATH);
+    unlink(RECOVERY_WAL_PATH);
+
+    for (u32 k = 0; k < 3; ++k)
+        free(parts[k]);
+    free(text);
+}
+
+typedef enum {
+    OP_READ = 0,
+    OP_UPDATE = 1,
+    OP_INSERT = 2,
+    OP_REMOVE = 3,
+    NUM_OPS = 4,
+} BenchOp;
+
+static const char *OP_STRS[NUM_OPS] = {"read", "update", "insert", "remove"};
+
+typedef enum {
+    DIST_UNIFORM = 0,
+    DIST_ZIPFIAN = 1,
+    DIST_LATEST = 2,
+} BenchDist;
+
+#define BENCH_KEY_MAX 128
+
+typedef struct {
+    u64 records;
+    u64 warmup;
+    u64 ops;
+    u32 threads;
+    BenchDist dist;
+    double theta;
+    u32 mix[NUM_OPS];
+    u32 key_min;
+    u32 key_max;
+    u32 buckets;
+    u32 ram_percent;
+    u64 cxl_kib;
+    u32 max_load;
+    u32 maint_ms;
+    u64 key_space;
+    u32 front;
+    u32 admit;
+    int codec;
+    const char *stats;
+} BenchConfig;
+
+// Zipfian ranks as generated by YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases"). The zeta sum is extended as the
+// number of items grows, which the latest distribution relies on.
+typedef struct {
+    u64 n;
+    double theta;
+    double alpha;
+    double zeta2;
+    double zetan;
+    double eta;
+} Zipf;
+
+typedef struct {
+    BenchConfig *cfg;
+    HashMap *map;
+    u32 index;
+    u64 *next_id;
+    u64 rng;
+    Zipf zipf;
+    u64 ops;
+    bool record;
+    u32 *latency;
+    u8 *types;
+    u64 elapsed;
+} BenchThread;
+
+static u64 mix64(u64 x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static u64 rng_next(u64 *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static double rng_unit(u64 *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static void zipf_grow(Zipf *zipf, u64 n) {
+    for (u64 i = zipf->n + 1; i <= n; ++i)
+        zipf->zetan += 1 / pow((double) i, zipf->theta);
+    zipf->n = n;
+    zipf->eta = (1 - pow(2.0 / n, 1 - zipf->theta)) /
+                (1 - zipf->zeta2 / zipf->zetan);
+}
+
+static void zipf_init(Zipf *zipf, u64 n, double theta) {
+    zipf->n = 0;
+    zipf->theta = theta;
+    zipf->alpha = 1 / (1 - theta);
+    zipf->zeta2 = 1 + 1 / pow(2, theta);
+    zipf->zetan = 0;
+    zipf_grow(zipf, n);
+}
+
+// Rank in [0, n), 0 being the most popular
+static u64 zipf_next(Zipf *zipf, u64 *rng, u64 n) {
+    if (n > zipf->n)
+        zipf_grow(zipf, n);
+
+    double u = rng_unit(rng);
+    double uz = u * zipf->zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + pow(0.5, zipf->theta))
+        return 1;
+
+    u64 rank = n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha);
+    return rank < n ? rank : n - 1;
+}
+
+// Zipfian ranks are scattered over every id the run may insert, so that hot
+// keys neither share chains nor move as inserts go on, and ids not inserted
+// yet are drawn again. Latest favours the keys inserted last.
+static u64 bench_pick(BenchThread *bt) {
+    u64 n = __atomic_load_n(bt->next_id, __ATOMIC_RELAXED);
+    u64 space = bt->cfg->key_space;
+    u64 id;
+
+    switch (bt->cfg->dist) {
+    case DIST_ZIPFIAN:
+        do {
+            id = mix64(zipf_next(&bt->zipf, &bt->rng, space)) % space;
+        } while (id >= n);
+        return id;
+    case DIST_LATEST:
+        return n - 1 - zipf_next(&bt->zipf, &bt->rng, n);
+    default:
+        return rng_next(&bt->rng) % n;
+    }
+}
+
+// The id comes first and ends at the dot, which keeps keys unique whatever
+// length the filler brings them to
+static void bench_key(BenchConfig *cfg, u64 id, char *key) {
+    u64 h = mix64(id);
+    u32 len = cfg->key_min + h % (cfg->key_max - cfg->key_min + 1);
+    u32 n = sprintf(key, "%lu.", id);
+
+    for (; n < len; ++n)
+        key[n] = 'a' + ((h >> (n % 12 * 5)) & 15);
+    key[n] = 0;
+}
+
+static BenchOp bench_op(BenchThread *bt) {
+    u32 r = rng_next(&bt->rng) % 100;
+    u32 op = 0;
+
+    while (op < NUM_OPS - 1 && r >= bt->cfg->mix[op]) {
+        r -= bt->cfg->mix[op];
+        op += 1;
+    }
+    return op;
+}
+
+static void *bench_run(void *arg) {
+    BenchThread *bt = arg;
+    char key[BENCH_KEY_MAX + 32];
+    Timer total;
+    Timer timer;
+    timer_start(&total);
+
+    for (u64 k = 0; k < bt->ops; ++k) {
+        BenchOp op = bench_op(bt);
+        u64 id = op == OP_INSERT
+                     ? __atomic_fetch_add(bt->next_id, 1, __ATOMIC_RELAXED)
+                     : bench_pick(bt);
+        bench_key(bt->cfg, id, key);
+        u64 value;
+
+        timer_start(&timer);
+        switch (op) {
+        case OP_READ:
+            hash_map_get(bt->map, key, &value);
+            break;
+        case OP_UPDATE:
+        case OP_INSERT:
+            hash_map_put(bt->map, key, id);
+            break;
+        default:
+            hash_map_remove(bt->map, key);
+            break;
+        }
+        u64 elapsed = timer_elapsed(&timer);
+
+        if (bt->record) {
+            bt->latency[k] = elapsed < UINT32_MAX ? elapsed : UINT32_MAX;
+            bt->types[k] = op;
+        }
+    }
+
+    bt->elapsed = timer_elapsed(&total);
+    return NULL;
+}
+
+static void *bench_load(void *arg) {
+    BenchThread *bt = arg;
+    char key[BENCH_KEY_MAX + 32];
+    Timer total;
+    timer_start(&total);
+
+    for (u64 id = bt->index; id < bt->cfg->records; id += bt->cfg->threads) {
+        bench_key(bt->cfg, id, key);
+        hash_map_put(bt->map, key, id);
+    }
+
+    bt->elapsed = timer_elapsed(&total);
+    return NULL;
+}
+
+// Runs every thread of the phase and returns the longest of their times
+static u64 bench_phase(
+    BenchThread *threads, u32 n, void *(*run)(void *)
+) {
+    pthread_t *ids = malloc(n * sizeof(*ids));
+    ASSERT(ids);
+    for (u32 t = 0; t < n; ++t)
+        ASSERT(pthread_create(ids + t, NULL, run, threads + t) == 0);
+
+    u64 elapsed = 0;
+    for (u32 t = 0; t < n; ++t) {
+        ASSERT(pthread_join(ids[t], NULL) == 0);
+        if (threads[t].elapsed > elapsed)
+            elapsed = threads[t].elapsed;
+    }
+
+    free(ids);
+    return elapsed;
+}
+
+static int u32_cmp(const void *a, const void *b) {
+    u32 x = *(const u32 *) a;
+    u32 y = *(const u32 *) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_percentiles(const char *name, u32 *latency, u64 n) {
+    if (n == 0)
+        return;
+
+    qsort(latency, n, sizeof(*latency), u32_cmp);
+    printf(
+        "%-7s %10lu ops  p50 %8u ns  p99 %8u ns  p99.9 %8u ns\n", name, n,
+        latency[(n - 1) / 2], latency[(n - 1) * 99 / 100],
+        latency[(n - 1) * 999 / 1000]
+    );
+}
+
+// Returns false for an unknown option
+static bool bench_option(BenchConfig *cfg, const char *arg) {
+    const char *eq = strchr(arg, '=');
+    if (!eq)
+        return false;
+
+    u64 name_len = eq - arg;
+    const char *value = eq + 1;
+#define OPTION(name) (name_len == strlen(name) && !strncmp(arg, name, name_len))
+
+    if (OPTION("records"))
+        cfg->records = atoll(value);
+    else if (OPTION("warmup"))
+        cfg->warmup = atoll(value);
+    else if (OPTION("ops"))
+        cfg->ops = atoll(value);
+    else if (OPTION("threads"))
+        cfg->threads = atoi(value);
+    else if (OPTION("dist") && !strcmp(value, "uniform"))
+        cfg->dist = DIST_UNIFORM;
+    else if (OPTION("dist") && !strcmp(value, "zipfian"))
+        cfg->dist = DIST_ZIPFIAN;
+    else if (OPTION("dist") && !strcmp(value, "latest"))
+        cfg->dist = DIST_LATEST;
+    else if (OPTION("theta"))
+        cfg->theta = atof(value);
+    else if (OPTION("mix"))
+        return sscanf(
+                   value, "%u/%u/%u/%u", cfg->mix + OP_READ,
+                   cfg->mix + OP_UPDATE, cfg->mix + OP_INSERT,
+                   cfg->mix + OP_REMOVE
+               ) == NUM_OPS;
+    else if (OPTION("keys"))
+        return sscanf(value, "%u-%u", &cfg->key_min, &cfg->key_max) == 2;
+    else if (OPTION("buckets"))
+        cfg->buckets = atoi(value);
+    else if (OPTION("ram"))
+        cfg->ram_percent = atoi(value);
+    else if (OPTION("cxl"))
+        cfg->cxl_kib = atoll(value);
+    else if (OPTION("load"))
+        cfg->max_load = atoi(value);
+    else if (OPTION("maint"))
+        cfg->maint_ms = atoi(value);
+    else if (OPTION("front"))
+        cfg->front = atoi(value);
+    else if (OPTION("admit"))
+        cfg->admit = atoi(value);
+    else if (OPTION("codec"))
+        cfg->codec = atoi(value);
+    else if (OPTION("stats"))
+        cfg->stats = value;
+    else
+        return false;
+
+#undef OPTION
+    return true;
+}
+
+// YCSB-style benchmark: loads `records` keys, runs `warmup` operations
+// unmeasured and then `ops` measured ones split over the threads. Options
+// are name=value pairs:
+//   dist=uniform|zipfian|latest theta=0.99 mix=read/update/insert/remove (in
+//   percent) keys=min-max (key lengths) threads=n buckets=n ram=percent
+//   cxl=KiB load=max_load maint=ms front=entries admit=width codec=n
+//   stats=text|json
+void bench(int argc, char **argv) {
+    BenchConfig cfg = {
+        .records = 100000,
+        .warmup = 100000,
+        .ops = 1000000,
+        .threads = 1,
+        .dist = DIST_ZIPFIAN,
+        .theta = 0.99,
+        .mix = {50, 45, 5, 0},
+        .key_min = 8,
+        .key_max = 24,
+        .ram_percent = 100,
+        .codec = -1,
+    };
+
+    while (argc > 0) {
+        const char *arg = NEXT_ARG(argv, argc);
+        if (!bench_option(&cfg, arg)) {
+            fprintf(stderr, "bench: bad option %s\n", arg);
+            exit(1);
+        }
+    }
+
+    ASSERT(cfg.records > 0 && cfg.threads > 0);
+    ASSERT(cfg.theta > 0 && cfg.theta < 1);
+    ASSERT(cfg.key_min <= cfg.key_max && cfg.key_max <= BENCH_KEY_MAX);
+    ASSERT(
+        cfg.mix[OP_READ] + cfg.mix[OP_UPDATE] + cfg.mix[OP_INSERT] +
+            cfg.mix[OP_REMOVE] ==
+        100
+    );
+
+    // Every id the inserts of the run may reach
+    cfg.key_space =
+        cfg.records + (cfg.warmup + cfg.ops) * cfg.mix[OP_INSERT] / 100;
+
+    // Room for every key that may be inserted, in each tier
+    u64 most = cfg.records + cfg.warmup + cfg.ops;
+    u64 entry = align_u64(cfg.key_max + 1 + sizeof(Entry));
+    u64 num_chunks = most * entry * 2 / 256 + (1 << 12);
+    if (cfg.buckets == 0)
+        cfg.buckets = cfg.records / 4 + 1;
+
+    TieredAllocator ta;
+    ta_init(&ta, 256, num_chunks);
+    if (cfg.codec >= 0)
+        ta_set_codec(&ta, cfg.codec, 0);
+
+    HashMap map;
+    hash_map_init(&map, &ta, cfg.buckets, cfg.buckets * cfg.ram_percent / 100);
+    if (cfg.cxl_kib)
+        hash_map_set_cxl_budget(&map, cfg.cxl_kib * 1024);
+    hash_map_set_max_load(&map, cfg.max_load);
+    hash_map_set_front_cache(&map, cfg.front);
+    hash_map_set_admission(&map, cfg.admit);
+    if (cfg.threads > 1 || cfg.maint_ms)
+        hash_map_set_concurrent(&map, 64);
+    if (cfg.maint_ms)
+        hash_map_start_maintenance(&map, cfg.maint_ms);
+
+    u64 next_id = cfg.records;
+    BenchThread *threads = calloc(cfg.threads, sizeof(*threads));
+    ASSERT(threads);
+
+    for (u32 t = 0; t < cfg.threads; ++t) {
+        BenchThread *bt = threads + t;
+        bt->cfg = &cfg;
+        bt->map = &map;
+        bt->next_id = &next_id;
+        bt->rng = mix64(t + 1);
+        bt->index = t;
+        zipf_init(
+            &bt->zipf,
+            cfg.dist == DIST_ZIPFIAN ? cfg.key_space : cfg.records, cfg.theta
+        );
     }
 
+    u64 elapsed = bench_phase(threads, cfg.threads, bench_load);
+    printf(
+        "load    %10lu ops  %.0f ops/s\n", cfg.records,
+        (double) cfg.records * NS_PER_SEC / elapsed
+    );
+
+    for (u32 t = 0; t < cfg.threads; ++t)
+        threads[t].ops = cfg.warmup / cfg.threads;
+    bench_phase(threads, cfg.threads, bench_run);
+
+    u64 per_thread = cfg.ops / cfg.threads;
+    for (u32 t = 0; t < cfg.threads; ++t) {
+        BenchThread *bt = threads + t;
+        bt->ops = per_thread;
+        bt->record = true;
+        bt->latency = malloc(per_thread * sizeof(*bt->latency));
+        bt->types = malloc(per_thread);
+        ASSERT(bt->latency);
+        ASSERT(bt->types);
+    }
+
+    elapsed = bench_phase(threads, cfg.threads, bench_run);
+    u64 total = per_thread * cfg.threads;
+    printf(
+        "run     %10lu ops  %.0f ops/s\n", total,
+        (double) total * NS_PER_SEC / elapsed
+    );
+
+    u32 *latency = malloc(total * sizeof(*latency));
+    ASSERT(latency);
+
+    for (u32 op = 0; op <= NUM_OPS; ++op) {
+        u64 n = 0;
+        for (u32 t = 0; t < cfg.threads; ++t) {
+            BenchThread *bt = threads + t;
+            for (u64 k = 0; k < per_thread; ++k) {
+                if (op == NUM_OPS || bt->types[k] == op)
+                    latency[n++] = bt->latency[k];
+            }
+        }
+        bench_percentiles(op == NUM_OPS ? "all" : OP_STRS[op], latency, n);
+    }
+
+    for (u32 t = 0; t < NUM_TIERS; ++t) {
+        printf(
+            "%s %.3f MiB  ", TIER_STRS[t],
+            (double) ta_memory_usage(&ta, t) / B_PER_MIB
+        );
+    }
+    printf(
+        "total %.3f MiB\n", (double) hash_map_mem_usage(&map) / B_PER_MIB
+    );
+
+    if (cfg.stats)
+        write_stats(&map, stdout, strcmp(cfg.stats, "json") == 0);
+
+    free(latency);
+    for (u32 t = 0; t < cfg.threads; ++t) {
+        free(threads[t].latency);
+        free(threads[t].types);
+    }
+    free(threads);
+    hash_map_deinit(&map);
     ta_deinit(&ta);
 }
 
@@ -151,4 +925,8 @@ int main(int argc, char **argv) {
         placement(argc, argv);
     else if (strcmp(cmd, "memory") == 0)
         memory(argc, argv);
+    else if (strcmp(cmd, "bench") == 0)
+        bench(argc, argv);
+    else if (strcmp(cmd, "recovery") == 0)
+        recovery(argc, argv);
 }
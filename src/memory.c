@@ -1,69 +1,1431 @@
 #include <lz4.h>
+#include <lz4hc.h>
 
+#include <sched.h>
 #include <stdlib.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 
 #include "common.h"
 #include "memory.h"
+#include "murmur/murmur3.h"
 
 const char *TIER_STRS[3] = {"RAM", "CXL", "SSD"};
 
-static void *mp_create(MemoryPool *mp) {
-    ASSERT(mp->free_list != NULL);
-    void *ptr = mp->free_list;
-    mp->free_list = *mp->free_list;
-    return ptr;
+#define NIL_CHUNK UINT32_MAX
+#define MAG_CAP 64
+#define MAG_BATCH 32
+#define SSD_IOV_MAX 64
+#define SSD_SPARE_MAX 64
+#define SSD_PREFETCH_MAX 256
+#define NIL_FRAME UINT32_MAX
+#define CXL_FRAME_WAYS 8
+
+// Adaptive compression runs both LZ4 codecs on one chunk in ADAPTIVE_SAMPLE
+// and settles on LZ4HC while it saves at least 1 / 2^ADAPTIVE_GAIN_SHIFT of
+// the LZ4 size for at most ADAPTIVE_MAX_SLOWDOWN times the time
+#define ADAPTIVE_SAMPLE 16
+#define ADAPTIVE_GAIN_SHIFT 3
+#define ADAPTIVE_MAX_SLOWDOWN 16
+
+// The backing file starts with a superblock, followed by the SSD chunks and
+// then the manifests written by ta_persist. The chunks start at the largest
+// page size in common use so that they can be mapped on any kernel.
+#define SSD_DEFAULT_PATH "/var/tmp/ssd"
+#define SSD_DATA_OFFSET (64 * 1024)
+#define SSD_MAGIC 0x31444353534d4854ULL
+#define SSD_VERSION 3
+
+// One in DICT_SAMPLE compressed chunks is copied into the dictionary window
+#define DICT_SAMPLE 8
+#define DICT_MAX_SIZE (64 * 1024)
+
+// The manifest holds a bitmap of the allocated SSD chunks, then the client's
+// bytes. clean is only set while the manifest matches the chunks.
+typedef struct {
+    u64 magic;
+    u32 version;
+    u32 clean;
+    u64 chunk_size;
+    u64 num_chunks;
+    u64 manifest_offset;
+    u64 manifest_size;
+    u64 manifest_hash;
+} SsdSuperblock;
+
+// Chunks cached by one thread for one tier. The counters are only written by
+// the owning thread and read atomically by ta_pool_stats. The chunks are
+// guarded by lock, which only other threads draining the magazine contend.
+typedef struct {
+    bool lock;
+    u32 count;
+    u32 chunks[MAG_CAP];
+    u64 creates;
+    u64 destroys;
+    u64 refills;
+    u64 spills;
+} Magazine;
+
+struct ThreadCache {
+    TieredAllocator *ta; // NULL once the allocator is deinitialized
+    u64 ta_id;
+    ThreadCache *next;
+    Magazine mags[NUM_TIERS];
+    TaStats stats;
+    u32 samples;
+};
+
+// Per-thread CXL codec buffers and the client's scratch, sized for the
+// largest chunk seen so far, and chunk caches, one per allocator the thread
+// has used
+typedef struct {
+    u64 cap;
+    void *scratch;
+    void *read_scratch;
+    void *codec_scratch;
+    void *client_scratch;
+    void *hc_state;
+    LZ4_stream_t *stream;
+    TieredAllocator *reader_ta;
+    Ptr reader;
+
+    ThreadCache **caches;
+    u32 num_caches;
+    ThreadCache *last;
+} ThreadState;
+
+static _Thread_local ThreadState *thread_state_ptr;
+static pthread_key_t thread_state_key;
+static pthread_once_t thread_state_once = PTHREAD_ONCE_INIT;
+
+// Guards every allocator's cache list and retired counters
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static u64 next_ta_id = 1;
+
+static void mp_push(MemoryPool *mp, const u32 *chunks, u32 n);
+
+static void stat_add(u64 *stat, u64 delta) {
+    __atomic_store_n(stat, *stat + delta, __ATOMIC_RELAXED);
+}
+
+static void stats_fold(PoolStats *stats, Magazine *mag) {
+    stats->creates += __atomic_load_n(&mag->creates, __ATOMIC_RELAXED);
+    stats->destroys += __atomic_load_n(&mag->destroys, __ATOMIC_RELAXED);
+    stats->refills += __atomic_load_n(&mag->refills, __ATOMIC_RELAXED);
+    stats->spills += __atomic_load_n(&mag->spills, __ATOMIC_RELAXED);
+}
+
+static void ta_stats_fold(TaStats *stats, TaStats *thread) {
+    u64 *sum = (u64 *) stats;
+    u64 *counters = (u64 *) thread;
+    for (u64 k = 0; k < sizeof(*stats) / sizeof(u64); ++k)
+        sum[k] += __atomic_load_n(counters + k, __ATOMIC_RELAXED);
+}
+
+static void mag_lock(Magazine *mag) {
+    while (__atomic_exchange_n(&mag->lock, true, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void mag_unlock(Magazine *mag) {
+    __atomic_store_n(&mag->lock, false, __ATOMIC_RELEASE);
+}
+
+static void cache_unlink(ThreadCache *cache) {
+    ThreadCache **link = &cache->ta->caches;
+    while (*link != cache)
+        link = &(*link)->next;
+    *link = cache->next;
+}
+
+// Hands the cached chunks back to the allocator on thread exit
+static void cache_retire(ThreadCache *cache) {
+    pthread_mutex_lock(&registry_lock);
+
+    if (cache->ta) {
+        for (u8 t = 0; t < NUM_TIERS; ++t) {
+            Magazine *mag = cache->mags + t;
+            if (mag->count > 0)
+                mp_push(cache->ta->pools + t, mag->chunks, mag->count);
+            stats_fold(cache->ta->retired + t, mag);
+        }
+        ta_stats_fold(&cache->ta->retired_stats, &cache->stats);
+
+        cache_unlink(cache);
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+    free(cache);
+}
+
+static void thread_state_free(void *arg) {
+    ThreadState *ts = arg;
+
+    for (u32 k = 0; k < ts->num_caches; ++k)
+        cache_retire(ts->caches[k]);
+
+    free(ts->caches);
+    free(ts->scratch);
+    free(ts->read_scratch);
+    free(ts->codec_scratch);
+    free(ts->client_scratch);
+    free(ts->hc_state);
+    if (ts->stream)
+        LZ4_freeStream(ts->stream);
+    free(ts);
+    thread_state_ptr = NULL;
+}
+
+static void thread_state_key_init(void) {
+    ASSERT(pthread_key_create(&thread_state_key, thread_state_free) == 0);
+}
+
+static ThreadState *thread_state(void) {
+    ThreadState *ts = thread_state_ptr;
+
+    if (ts == NULL) {
+        pthread_once(&thread_state_once, thread_state_key_init);
+        ts = calloc(1, sizeof(*ts));
+        ASSERT(ts);
+        ts->reader = null_ptr();
+        ASSERT(pthread_setspecific(thread_state_key, ts) == 0);
+        thread_state_ptr = ts;
+    }
+
+    return ts;
+}
+
+static ThreadState *thread_scratch(TieredAllocator *ta) {
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+    ThreadState *ts = thread_state();
+
+    if (ts->cap < chunk_cap) {
+        ASSERT(is_null_ptr(ts->reader));
+        free(ts->scratch);
+        free(ts->read_scratch);
+        free(ts->codec_scratch);
+        free(ts->client_scratch);
+        ts->scratch = malloc(chunk_cap);
+        ts->read_scratch = malloc(chunk_cap);
+        ts->codec_scratch = malloc(chunk_cap);
+        ts->client_scratch = malloc(2 * chunk_cap);
+        ASSERT(ts->scratch);
+        ASSERT(ts->read_scratch);
+        ASSERT(ts->codec_scratch);
+        ASSERT(ts->client_scratch);
+        ts->cap = chunk_cap;
+    }
+
+    return ts;
+}
+
+static ThreadCache *thread_cache(TieredAllocator *ta) {
+    ThreadState *ts = thread_state();
+
+    if (ts->last && ts->last->ta_id == ta->id)
+        return ts->last;
+
+    for (u32 k = 0; k < ts->num_caches; ++k) {
+        if (ts->caches[k]->ta_id == ta->id) {
+            ts->last = ts->caches[k];
+            return ts->last;
+        }
+    }
+
+    pthread_mutex_lock(&registry_lock);
+
+    // Reuse the cache of an allocator that has since been deinitialized
+    ThreadCache *cache = NULL;
+    for (u32 k = 0; k < ts->num_caches && !cache; ++k) {
+        if (ts->caches[k]->ta == NULL)
+            cache = ts->caches[k];
+    }
+
+    if (cache == NULL) {
+        u32 n = ts->num_caches + 1;
+        ts->caches = realloc(ts->caches, n * sizeof(*ts->caches));
+        ASSERT(ts->caches);
+        cache = malloc(sizeof(*cache));
+        ASSERT(cache);
+        ts->caches[ts->num_caches] = cache;
+        ts->num_caches = n;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    cache->ta = ta;
+    cache->ta_id = ta->id;
+    cache->next = ta->caches;
+    ta->caches = cache;
+
+    pthread_mutex_unlock(&registry_lock);
+
+    ts->last = cache;
+    return cache;
+}
+
+static bool is_thread_reader(TieredAllocator *ta, Ptr ptr) {
+    ThreadState *ts = thread_state_ptr;
+    return ts && ts->reader_ta == ta && ts->reader == ptr;
+}
+
+static void usage_add(TieredAllocator *ta, MemoryTier tier, u64 delta) {
+    __atomic_fetch_add(ta->memory_usage + tier, delta, __ATOMIC_RELAXED);
+}
+
+static u64 mp_tagged(u64 head, u32 index) {
+    return ((head >> 32) + 1) << 32 | index;
+}
+
+static u32 mp_pop(MemoryPool *mp) {
+    u64 head = __atomic_load_n(&mp->head, __ATOMIC_ACQUIRE);
+
+    while ((u32) head != NIL_CHUNK) {
+        u32 next = __atomic_load_n(mp->next + (u32) head, __ATOMIC_RELAXED);
+        u64 popped = mp_tagged(head, next);
+
+        if (__atomic_compare_exchange_n(
+                &mp->head, &head, popped, true, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE
+            )) {
+            __atomic_fetch_sub(&mp->free, 1, __ATOMIC_RELAXED);
+            return (u32) head;
+        }
+    }
+
+    return NIL_CHUNK;
+}
+
+// Links chunks[0..n) into one run and publishes it with a single CAS, so a
+// pop returns chunks[0] first
+static void mp_push(MemoryPool *mp, const u32 *chunks, u32 n) {
+    for (u32 k = 0; k + 1 < n; ++k)
+        __atomic_store_n(mp->next + chunks[k], chunks[k + 1], __ATOMIC_RELAXED);
+
+    u32 last = chunks[n - 1];
+    u64 head = __atomic_load_n(&mp->head, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(mp->next + last, (u32) head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(
+        &mp->head, &head, mp_tagged(head, chunks[0]), true, __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED
+    ));
+
+    __atomic_fetch_add(&mp->free, n, __ATOMIC_RELAXED);
+}
+
+static bool bit_get(const u64 *bits, u64 i) {
+    return bits[i >> 6] >> (i & 63) & 1;
+}
+
+// Free chunks start out linked in address order so that fresh allocations
+// are handed out sequentially. Those set in `used`, if given, are left out.
+static void mp_init(MemoryPool *mp, u64 num_chunks, const u64 *used) {
+    mp->next = malloc(num_chunks * sizeof(*mp->next));
+    ASSERT(num_chunks == 0 || mp->next);
+
+    mp->head = NIL_CHUNK;
+    mp->free = 0;
+
+    for (u64 i = num_chunks; i-- > 0;) {
+        if (used && bit_get(used, i))
+            continue;
+        mp->next[i] = (u32) mp->head;
+        mp->head = i;
+        mp->free += 1;
+    }
+}
+
+// Refills an empty magazine with a batch from the shared pool. The batch is
+// stacked so that it is handed out in the order the pool gave it.
+static void cache_refill(TieredAllocator *ta, MemoryTier tier, Magazine *mag) {
+    u32 batch[MAG_BATCH];
+    u32 n = 0;
+
+    while (n < MAG_BATCH) {
+        u32 chunk = mp_pop(ta->pools + tier);
+        if (chunk == NIL_CHUNK)
+            break;
+        batch[n++] = chunk;
+    }
+
+    for (u32 k = 0; k < n; ++k)
+        mag->chunks[k] = batch[n - 1 - k];
+    __atomic_store_n(&mag->count, n, __ATOMIC_RELAXED);
+    stat_add(&mag->refills, 1);
+}
+
+// Moves the chunks cached by every other thread back to the shared pool,
+// for when it has run dry
+static void cache_drain(TieredAllocator *ta, MemoryTier tier, Magazine *own) {
+    pthread_mutex_lock(&registry_lock);
+
+    for (ThreadCache *cache = ta->caches; cache; cache = cache->next) {
+        Magazine *mag = cache->mags + tier;
+        if (mag == own)
+            continue;
+
+        mag_lock(mag);
+        if (mag->count > 0) {
+            mp_push(ta->pools + tier, mag->chunks, mag->count);
+            __atomic_store_n(&mag->count, 0, __ATOMIC_RELAXED);
+            stat_add(&mag->spills, 1);
+        }
+        mag_unlock(mag);
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Takes a chunk from the thread's magazine, refilling it when empty
+static u32 cache_pop(TieredAllocator *ta, MemoryTier tier) {
+    Magazine *mag = thread_cache(ta)->mags + tier;
+    mag_lock(mag);
+
+    if (mag->count == 0)
+        cache_refill(ta, tier, mag);
+
+    // The own lock is dropped while draining, as other threads may hold
+    // theirs waiting for the registry
+    if (mag->count == 0) {
+        mag_unlock(mag);
+        cache_drain(ta, tier, mag);
+        mag_lock(mag);
+        if (mag->count == 0)
+            cache_refill(ta, tier, mag);
+    }
+
+    ASSERT(mag->count > 0);
+    __atomic_store_n(&mag->count, mag->count - 1, __ATOMIC_RELAXED);
+    stat_add(&mag->creates, 1);
+    u32 chunk = mag->chunks[mag->count];
+    mag_unlock(mag);
+    return chunk;
+}
+
+// Returns a chunk to the thread's magazine. A full magazine first spills its
+// oldest half to the shared pool.
+static void cache_push(TieredAllocator *ta, MemoryTier tier, u32 chunk) {
+    Magazine *mag = thread_cache(ta)->mags + tier;
+    mag_lock(mag);
+
+    if (mag->count == MAG_CAP) {
+        mp_push(ta->pools + tier, mag->chunks, MAG_BATCH);
+        memmove(
+            mag->chunks, mag->chunks + MAG_BATCH,
+            (MAG_CAP - MAG_BATCH) * sizeof(*mag->chunks)
+        );
+        __atomic_store_n(&mag->count, MAG_CAP - MAG_BATCH, __ATOMIC_RELAXED);
+        stat_add(&mag->spills, 1);
+    }
+
+    mag->chunks[mag->count] = chunk;
+    __atomic_store_n(&mag->count, mag->count + 1, __ATOMIC_RELAXED);
+    stat_add(&mag->destroys, 1);
+    mag_unlock(mag);
+}
+
+// Read-ahead state of a chunk. A stale read was overtaken by a flush, destroy
+// or acquire and its frame is dropped.
+#define READ_QUEUED 1
+#define READ_RUNNING 2
+#define READ_STALE 4
+
+static bool is_ssd_pio(TieredAllocator *ta, MemoryTier tier) {
+    return tier == TIER_SSD && ta->ssd_backend == SSD_PIO;
+}
+
+static off_t ssd_offset(TieredAllocator *ta, u64 chunk_num) {
+    return SSD_DATA_OFFSET + chunk_num * chunk_bound(ta->chunk_size);
+}
+
+static void ssd_mmap_init(TieredAllocator *ta) {
+    long page = sysconf(_SC_PAGESIZE);
+    ASSERT(SSD_DATA_OFFSET / page * page == SSD_DATA_OFFSET);
+    ta->buffers[TIER_SSD] = mmap(
+        NULL, ta->cap, PROT_READ | PROT_WRITE, MAP_SHARED, ta->backing_fd,
+        SSD_DATA_OFFSET
+    );
+    ASSERT(ta->buffers[TIER_SSD] != MAP_FAILED);
+}
+
+static int chunk_cmp(const void *a, const void *b) {
+    u32 x = *(const u32 *) a;
+    u32 y = *(const u32 *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Writes the sorted batch with one pwritev per run of adjacent chunks. The
+// slack between a chunk's contents and the next slot is written from zero.
+static void ssd_write_batch(
+    TieredAllocator *ta, const u32 *batch, u64 n, void *zero
+) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+    u64 slack = chunk_cap - ta->chunk_size;
+    struct iovec iov[SSD_IOV_MAX];
+
+    for (u64 k = 0; k < n;) {
+        u64 end = k;
+        int iovcnt = 0;
+        u64 len = 0;
+
+        while (end < n && iovcnt + 2 <= SSD_IOV_MAX &&
+               (end == k || batch[end] == batch[end - 1] + 1)) {
+            if (end > k && slack > 0) {
+                iov[iovcnt++] = (struct iovec) {zero, slack};
+                len += slack;
+            }
+            iov[iovcnt++] =
+                (struct iovec) {wb->inflight[batch[end]], ta->chunk_size};
+            len += ta->chunk_size;
+            end += 1;
+        }
+
+        ssize_t written =
+            pwritev(ta->backing_fd, iov, iovcnt, ssd_offset(ta, batch[k]));
+        ASSERT(written == (ssize_t) len);
+        k = end;
+    }
+}
+
+// Frame pool, used under the lock
+static void *spare_get(TieredAllocator *ta) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    if (wb->num_spare > 0)
+        return wb->spare[--wb->num_spare];
+
+    void *frame = malloc(ta->chunk_size);
+    ASSERT(frame);
+    return frame;
+}
+
+static void spare_put(SsdWriteback *wb, void *frame) {
+    if (frame == NULL)
+        return;
+    if (wb->num_spare < SSD_SPARE_MAX)
+        wb->spare[wb->num_spare++] = frame;
+    else
+        free(frame);
+}
+
+// Drops a prefetched frame and marks a read still to finish as stale, once
+// the chunk's contents on disk no longer hold
+static void prefetch_drop(SsdWriteback *wb, u64 chunk_num) {
+    if (wb->prefetched[chunk_num]) {
+        spare_put(wb, wb->prefetched[chunk_num]);
+        wb->prefetched[chunk_num] = NULL;
+        wb->num_prefetched -= 1;
+    }
+    if (wb->reads[chunk_num])
+        wb->reads[chunk_num] |= READ_STALE;
+}
+
+static void *ssd_writer(void *arg) {
+    TieredAllocator *ta = arg;
+    SsdWriteback *wb = &ta->ssd_wb;
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+    u32 *batch = malloc(ta->cap / chunk_cap * sizeof(*batch));
+    void *zero = calloc(1, chunk_cap);
+    ASSERT(batch);
+    ASSERT(zero);
+
+    pthread_mutex_lock(&wb->lock);
+
+    while (true) {
+        while (wb->queue_len == 0 && !wb->stop)
+            pthread_cond_wait(&wb->wake, &wb->lock);
+        if (wb->queue_len == 0)
+            break;
+
+        // Take the whole queue. Chunks destroyed since their flush have
+        // nothing pending and are skipped.
+        u64 n = 0;
+        for (u64 k = 0; k < wb->queue_len; ++k) {
+            u32 chunk = wb->queue[k];
+            wb->queued[chunk] = false;
+            if (wb->pending[chunk] == NULL)
+                continue;
+
+            wb->inflight[chunk] = wb->pending[chunk];
+            wb->pending[chunk] = NULL;
+            batch[n++] = chunk;
+        }
+        wb->queue_len = 0;
+        wb->writing = true;
+        pthread_mutex_unlock(&wb->lock);
+
+        qsort(batch, n, sizeof(*batch), chunk_cmp);
+        ssd_write_batch(ta, batch, n, zero);
+
+        pthread_mutex_lock(&wb->lock);
+        for (u64 k = 0; k < n; ++k) {
+            spare_put(wb, wb->inflight[batch[k]]);
+            wb->inflight[batch[k]] = NULL;
+        }
+        wb->writing = false;
+        if (wb->queue_len == 0)
+            pthread_cond_broadcast(&wb->idle);
+    }
+
+    pthread_mutex_unlock(&wb->lock);
+    free(batch);
+    free(zero);
+    return NULL;
+}
+
+static void *ssd_reader(void *arg) {
+    TieredAllocator *ta = arg;
+    SsdWriteback *wb = &ta->ssd_wb;
+    u32 *batch = malloc(ta->cap / chunk_bound(ta->chunk_size) * sizeof(*batch));
+    ASSERT(batch);
+
+    pthread_mutex_lock(&wb->lock);
+
+    while (true) {
+        while (wb->read_len == 0 && !wb->stop)
+            pthread_cond_wait(&wb->read_wake, &wb->lock);
+        if (wb->stop)
+            break;
+
+        u64 n = wb->read_len;
+        memcpy(batch, wb->read_queue, n * sizeof(*batch));
+        wb->read_len = 0;
+        pthread_mutex_unlock(&wb->lock);
+        qsort(batch, n, sizeof(*batch), chunk_cmp);
+        pthread_mutex_lock(&wb->lock);
+
+        for (u64 k = 0; k < n && !wb->stop; ++k) {
+            u32 chunk = batch[k];
+            if (wb->reads[chunk] & READ_STALE) {
+                wb->reads[chunk] = 0;
+                continue;
+            }
+
+            wb->reads[chunk] = READ_RUNNING;
+            void *frame = spare_get(ta);
+            pthread_mutex_unlock(&wb->lock);
+
+            ssize_t r = pread(
+                ta->backing_fd, frame, ta->chunk_size, ssd_offset(ta, chunk)
+            );
+            ASSERT(r == (ssize_t) ta->chunk_size);
+
+            pthread_mutex_lock(&wb->lock);
+            if (wb->reads[chunk] & READ_STALE) {
+                spare_put(wb, frame);
+            }
+            else {
+                wb->prefetched[chunk] = frame;
+                wb->num_prefetched += 1;
+            }
+            wb->reads[chunk] = 0;
+            pthread_cond_broadcast(&wb->read_done);
+        }
+    }
+
+    pthread_mutex_unlock(&wb->lock);
+    free(batch);
+    return NULL;
+}
+
+static void ssd_pio_init(TieredAllocator *ta) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    u64 num_chunks = ta->cap / chunk_bound(ta->chunk_size);
+
+    ta->buffers[TIER_SSD] = NULL;
+    ta->ssd_frames = calloc(num_chunks, sizeof(*ta->ssd_frames));
+    wb->pending = calloc(num_chunks, sizeof(*wb->pending));
+    wb->inflight = calloc(num_chunks, sizeof(*wb->inflight));
+    wb->queued = calloc(num_chunks, sizeof(*wb->queued));
+    wb->queue = malloc(num_chunks * sizeof(*wb->queue));
+    wb->prefetched = calloc(num_chunks, sizeof(*wb->prefetched));
+    wb->reads = calloc(num_chunks, sizeof(*wb->reads));
+    wb->read_queue = malloc(num_chunks * sizeof(*wb->read_queue));
+    wb->spare = malloc(SSD_SPARE_MAX * sizeof(*wb->spare));
+    ASSERT(ta->ssd_frames);
+    ASSERT(wb->pending);
+    ASSERT(wb->inflight);
+    ASSERT(wb->queued);
+    ASSERT(wb->queue);
+    ASSERT(wb->prefetched);
+    ASSERT(wb->reads);
+    ASSERT(wb->read_queue);
+    ASSERT(wb->spare);
+
+    wb->queue_len = 0;
+    wb->writing = false;
+    wb->stop = false;
+    wb->read_len = 0;
+    wb->num_prefetched = 0;
+    wb->num_spare = 0;
+    ASSERT(pthread_mutex_init(&wb->lock, NULL) == 0);
+    ASSERT(pthread_cond_init(&wb->wake, NULL) == 0);
+    ASSERT(pthread_cond_init(&wb->idle, NULL) == 0);
+    ASSERT(pthread_cond_init(&wb->read_wake, NULL) == 0);
+    ASSERT(pthread_cond_init(&wb->read_done, NULL) == 0);
+    ASSERT(pthread_create(&wb->writer, NULL, ssd_writer, ta) == 0);
+    ASSERT(pthread_create(&wb->reader, NULL, ssd_reader, ta) == 0);
+}
+
+// The writer drains the queue before it exits, queued reads are dropped
+static void ssd_pio_deinit(TieredAllocator *ta) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    u64 num_chunks = ta->cap / chunk_bound(ta->chunk_size);
+
+    pthread_mutex_lock(&wb->lock);
+    wb->stop = true;
+    pthread_cond_signal(&wb->wake);
+    pthread_cond_signal(&wb->read_wake);
+    pthread_mutex_unlock(&wb->lock);
+    ASSERT(pthread_join(wb->writer, NULL) == 0);
+    ASSERT(pthread_join(wb->reader, NULL) == 0);
+
+    for (u64 i = 0; i < num_chunks; ++i)
+        free(wb->prefetched[i]);
+    for (u32 k = 0; k < wb->num_spare; ++k)
+        free(wb->spare[k]);
+
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->wake);
+    pthread_cond_destroy(&wb->idle);
+    pthread_cond_destroy(&wb->read_wake);
+    pthread_cond_destroy(&wb->read_done);
+    free(ta->ssd_frames);
+    free(wb->pending);
+    free(wb->inflight);
+    free(wb->queued);
+    free(wb->queue);
+    free(wb->prefetched);
+    free(wb->reads);
+    free(wb->read_queue);
+    free(wb->spare);
+    ta->ssd_frames = NULL;
+}
+
+// Takes the chunk into a private frame: its newest unwritten contents when a
+// write-back is still queued or running, else the prefetched frame, waiting
+// for the read if it is running, else a read of its own. A read still queued
+// is left to go stale rather than waited for.
+static void *ssd_pio_acquire(TieredAllocator *ta, u64 chunk_num) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    pthread_mutex_lock(&wb->lock);
+
+    while (wb->reads[chunk_num] & READ_RUNNING)
+        pthread_cond_wait(&wb->read_done, &wb->lock);
+
+    void *src = wb->pending[chunk_num];
+    if (src == NULL)
+        src = wb->inflight[chunk_num];
+
+    void *frame = NULL;
+    if (src == NULL && wb->prefetched[chunk_num]) {
+        frame = wb->prefetched[chunk_num];
+        wb->prefetched[chunk_num] = NULL;
+        wb->num_prefetched -= 1;
+    }
+
+    bool read = false;
+    if (frame == NULL) {
+        prefetch_drop(wb, chunk_num);
+        frame = spare_get(ta);
+        if (src)
+            memcpy(frame, src, ta->chunk_size);
+        read = src == NULL;
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    if (read) {
+        ssize_t n = pread(
+            ta->backing_fd, frame, ta->chunk_size, ssd_offset(ta, chunk_num)
+        );
+        ASSERT(n == (ssize_t) ta->chunk_size);
+    }
+
+    ta->ssd_frames[chunk_num] = frame;
+    return frame;
+}
+
+static void ssd_pio_release(TieredAllocator *ta, u64 chunk_num) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    pthread_mutex_lock(&wb->lock);
+    spare_put(wb, ta->ssd_frames[chunk_num]);
+    pthread_mutex_unlock(&wb->lock);
+    ta->ssd_frames[chunk_num] = NULL;
+}
+
+// Hands the frame to the writer, replacing any contents still pending
+static void ssd_pio_flush(TieredAllocator *ta, u64 chunk_num) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    void *frame = ta->ssd_frames[chunk_num];
+    ta->ssd_frames[chunk_num] = NULL;
+
+    pthread_mutex_lock(&wb->lock);
+    spare_put(wb, wb->pending[chunk_num]);
+    wb->pending[chunk_num] = frame;
+    prefetch_drop(wb, chunk_num);
+    if (!wb->queued[chunk_num]) {
+        wb->queued[chunk_num] = true;
+        wb->queue[wb->queue_len++] = chunk_num;
+        pthread_cond_signal(&wb->wake);
+    }
+    pthread_mutex_unlock(&wb->lock);
+}
+
+static void ssd_pio_destroy(TieredAllocator *ta, u64 chunk_num) {
+    SsdWriteback *wb = &ta->ssd_wb;
+    ssd_pio_release(ta, chunk_num);
+
+    pthread_mutex_lock(&wb->lock);
+    spare_put(wb, wb->pending[chunk_num]);
+    wb->pending[chunk_num] = NULL;
+    prefetch_drop(wb, chunk_num);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static TaStats *thread_stats(TieredAllocator *ta) {
+    return &thread_cache(ta)->stats;
+}
+
+// Returns the counters of the calling thread, and in *start the time an
+// acquire or flush begins at when it is one to sample, 0 otherwise
+static TaStats *sample_begin(TieredAllocator *ta, u64 *start) {
+    ThreadCache *cache = thread_cache(ta);
+    bool sample = (++cache->samples & ((1u << STATS_SAMPLE_SHIFT) - 1)) == 0;
+    *start = sample ? now_ns() : 0;
+    return &cache->stats;
+}
+
+static u32 latency_bucket(u64 ns) {
+    u32 bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+static void acquire_done(TaStats *stats, MemoryTier tier, u64 start) {
+    TierStats *tier_stats = stats->tiers + tier;
+    stat_add(&tier_stats->acquires, 1);
+    if (start == 0)
+        return;
+
+    u64 ns = now_ns() - start;
+    stat_add(&tier_stats->acquire_ns, ns);
+    stat_add(tier_stats->acquire_hist + latency_bucket(ns), 1);
+}
+
+static void flush_done(TaStats *stats, MemoryTier tier, u64 start) {
+    TierStats *tier_stats = stats->tiers + tier;
+    stat_add(&tier_stats->flushes, 1);
+    if (start != 0)
+        stat_add(tier_stats->flush_hist + latency_bucket(now_ns() - start), 1);
+}
+
+// Compresses against the current dictionary, if any, by copying its
+// preloaded stream state rather than hashing the dictionary again
+static u32 compress_lz4(
+    TieredAllocator *ta, ThreadState *ts, const void *src, void *dst,
+    int acceleration, u8 *dict
+) {
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+    *dict = __atomic_load_n(&ta->dict_current, __ATOMIC_ACQUIRE);
+
+    if (*dict == 0) {
+        return LZ4_compress_fast(
+            src, dst, ta->chunk_size, chunk_cap, acceleration
+        );
+    }
+
+    if (ts->stream == NULL) {
+        ts->stream = LZ4_createStream();
+        ASSERT(ts->stream);
+    }
+
+    memcpy(ts->stream, ta->dicts[*dict].stream, sizeof(*ts->stream));
+    return LZ4_compress_fast_continue(
+        ts->stream, src, dst, ta->chunk_size, chunk_cap, acceleration
+    );
+}
+
+static u32 compress_hc(
+    TieredAllocator *ta, ThreadState *ts, const void *src, void *dst, int level
+) {
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+
+    if (ts->hc_state == NULL) {
+        ts->hc_state = malloc(LZ4_sizeofStateHC());
+        ASSERT(ts->hc_state);
+    }
+
+    return LZ4_compress_HC_extStateHC(
+        ts->hc_state, src, dst, ta->chunk_size, chunk_cap, level
+    );
+}
+
+// Moves an average an eighth of the way towards a new sample
+static void ewma_update(u64 *avg, u64 sample) {
+    u64 old = __atomic_load_n(avg, __ATOMIC_RELAXED);
+    u64 next = old == 0 ? sample : old - (old >> 3) + (sample >> 3);
+    __atomic_store_n(avg, next, __ATOMIC_RELAXED);
+}
+
+// Samples run both codecs, keep the smaller output and update the averages
+// the choice for the other chunks is made from. The averages are shared
+// between threads without a lock, losing an update now and then is fine.
+static u32 compress_adaptive(
+    TieredAllocator *ta, ThreadState *ts, const void *src, void *dst,
+    u8 *codec, u8 *dict
+) {
+    AdaptiveCodec *ad = &ta->adaptive;
+    int level = ta->codec_level ? ta->codec_level : LZ4HC_CLEVEL_DEFAULT;
+    u32 tick = __atomic_fetch_add(&ad->ticks, 1, __ATOMIC_RELAXED);
+
+    if (tick % ADAPTIVE_SAMPLE != 0) {
+        if (__atomic_load_n(&ad->use_hc, __ATOMIC_RELAXED)) {
+            *codec = CODEC_LZ4HC;
+            return compress_hc(ta, ts, src, dst, level);
+        }
+
+        *codec = CODEC_LZ4;
+        return compress_lz4(ta, ts, src, dst, 1, dict);
+    }
+
+    u64 start = now_ns();
+    u32 lz4_size = compress_lz4(ta, ts, src, dst, 1, dict);
+    u64 mid = now_ns();
+    u32 hc_size = compress_hc(ta, ts, src, ts->codec_scratch, level);
+    u64 end = now_ns();
+
+    ewma_update(&ad->lz4_size, lz4_size);
+    ewma_update(&ad->hc_size, hc_size);
+    ewma_update(&ad->lz4_ns, mid - start);
+    ewma_update(&ad->hc_ns, end - mid);
+
+    u64 lz4_avg = __atomic_load_n(&ad->lz4_size, __ATOMIC_RELAXED);
+    u64 hc_avg = __atomic_load_n(&ad->hc_size, __ATOMIC_RELAXED);
+    u64 lz4_ns = __atomic_load_n(&ad->lz4_ns, __ATOMIC_RELAXED);
+    u64 hc_ns = __atomic_load_n(&ad->hc_ns, __ATOMIC_RELAXED);
+    bool use_hc = hc_avg < lz4_avg &&
+                  (lz4_avg - hc_avg) << ADAPTIVE_GAIN_SHIFT >= lz4_avg &&
+                  hc_ns <= lz4_ns * ADAPTIVE_MAX_SLOWDOWN;
+    __atomic_store_n(&ad->use_hc, use_hc, __ATOMIC_RELAXED);
+
+    if (hc_size < lz4_size) {
+        memcpy(dst, ts->codec_scratch, hc_size);
+        *codec = CODEC_LZ4HC;
+        *dict = 0;
+        return hc_size;
+    }
+
+    *codec = CODEC_LZ4;
+    return lz4_size;
+}
+
+// Copies one in DICT_SAMPLE chunks into the dictionary window, retraining
+// whenever the window has been refilled a power of two times. Early versions
+// see a young data set, the backoff bounds how many versions pile up.
+static void dict_sample(TieredAllocator *ta, const void *src) {
+    if (ta->dict_ring == NULL)
+        return;
+    if (__atomic_fetch_add(&ta->dict_ticks, 1, __ATOMIC_RELAXED) % DICT_SAMPLE)
+        return;
+
+    bool train = false;
+    pthread_mutex_lock(&ta->dict_lock);
+
+    memcpy(ta->dict_ring + ta->dict_pos, src, ta->chunk_size);
+    ta->dict_pos += ta->chunk_size;
+    if (ta->dict_pos == ta->dict_size) {
+        ta->dict_pos = 0;
+        ta->dict_full = true;
+        ta->dict_wraps += 1;
+        train = (ta->dict_wraps & (ta->dict_wraps - 1)) == 0;
+    }
+
+    pthread_mutex_unlock(&ta->dict_lock);
+
+    if (train)
+        ta_train_dict(ta);
+}
+
+// Compresses a chunk into dst, which holds chunk_bound bytes, with the
+// allocator's codec. Records the codec and dictionary the chunk was stored
+// with, raw whenever compression would not shrink it, and returns its size.
+static u32 codec_compress(
+    TieredAllocator *ta, const void *src, void *dst, u64 chunk_num
+) {
+    ThreadState *ts = thread_scratch(ta);
+    u8 *codec = ta->cxl_codec + chunk_num;
+    u8 *dict = ta->cxl_dict + chunk_num;
+    u32 size = ta->chunk_size;
+    *codec = ta->codec;
+    *dict = 0;
+
+    dict_sample(ta, src);
+
+    switch (ta->codec) {
+    case CODEC_LZ4: {
+        int acceleration = ta->codec_level ? ta->codec_level : 1;
+        size = compress_lz4(ta, ts, src, dst, acceleration, dict);
+        break;
+    }
+    case CODEC_LZ4HC: {
+        int level = ta->codec_level ? ta->codec_level : LZ4HC_CLEVEL_DEFAULT;
+        size = compress_hc(ta, ts, src, dst, level);
+        break;
+    }
+    case CODEC_ADAPTIVE:
+        size = compress_adaptive(ta, ts, src, dst, codec, dict);
+        break;
+    default:
+        break;
+    }
+
+    if (size == 0 || size >= ta->chunk_size) {
+        memcpy(dst, src, ta->chunk_size);
+        size = ta->chunk_size;
+        *codec = CODEC_RAW;
+        *dict = 0;
+    }
+
+    __atomic_fetch_add(ta->codec_uses + *codec, 1, __ATOMIC_RELAXED);
+    TaStats *stats = thread_stats(ta);
+    stat_add(&stats->compressed_in, ta->chunk_size);
+    stat_add(&stats->compressed_out, size);
+    return size;
+}
+
+// Decodes the stored bytes of chunk_num from src into dst
+static void codec_decompress(
+    TieredAllocator *ta, u64 chunk_num, const void *src, void *dst
+) {
+    if (ta->cxl_codec[chunk_num] == CODEC_RAW) {
+        memcpy(dst, src, ta->chunk_size);
+        return;
+    }
+
+    u32 size = ta->cxl_usage[chunk_num];
+    stat_add(&thread_stats(ta)->decompressed, ta->chunk_size);
+    CxlDict *dict = ta->dicts + ta->cxl_dict[chunk_num];
+    int n = ta->cxl_dict[chunk_num] == 0
+                ? LZ4_decompress_safe(src, dst, size, ta->chunk_size)
+                : LZ4_decompress_safe_usingDict(
+                      src, dst, size, ta->chunk_size, dict->data, dict->size
+                  );
+    ASSERT(n == (int) ta->chunk_size);
+}
+
+// Stores the compressed bytes of chunk_num, moving them to a slab of another
+// size class when their size has left the class of the previous bytes
+static void cxl_store(
+    TieredAllocator *ta, u64 chunk_num, const void *src, u32 size
+) {
+    void *payload = ta->cxl_payload[chunk_num];
+
+    if (!payload || sa_class(size) != sa_class(ta->cxl_usage[chunk_num])) {
+        if (payload)
+            sa_free(&ta->cxl_slabs, payload);
+        payload = sa_alloc(&ta->cxl_slabs, size);
+        ta->cxl_payload[chunk_num] = payload;
+    }
+
+    memcpy(payload, src, size);
+    ta->cxl_usage[chunk_num] = size;
+}
+
+// Decompressed copy of a chunk borrowed for writing outside the frame pool,
+// freed by the flush that compresses it back
+static void *cxl_work_alloc(TieredAllocator *ta, u64 chunk_num) {
+    void *work = malloc(ta->chunk_size);
+    ASSERT(work);
+    ta->cxl_work[chunk_num] = work;
+    return work;
+}
+
+static u8 *frame_data(TieredAllocator *ta, u32 f) {
+    return ta->cxl_frames.data + (u64) f * ta->chunk_size;
+}
+
+// Frame holding a chunk the caller has borrowed, NIL_FRAME when it was
+// borrowed in place because its set was fully pinned
+static u32 frame_of(TieredAllocator *ta, u64 chunk_num) {
+    if (ta->cxl_frames.num_sets == 0)
+        return NIL_FRAME;
+    return ta->cxl_frames.frame_of[chunk_num];
+}
+
+// Compresses frame f back into its chunk. Runs under the set lock.
+static void frame_write_back(TieredAllocator *ta, u32 f) {
+    CxlFramePool *fp = &ta->cxl_frames;
+    CxlFrame *frame = fp->frames + f;
+    ThreadState *ts = thread_scratch(ta);
+
+    u32 usage =
+        codec_compress(ta, frame_data(ta, f), ts->scratch, frame->chunk);
+    cxl_store(ta, frame->chunk, ts->scratch, usage);
+
+    frame->dirty = false;
+    __atomic_fetch_add(&fp->writebacks, 1, __ATOMIC_RELAXED);
+}
+
+// Clock over the frames of a set: pinned frames are skipped and referenced
+// ones get a second chance. Runs under the set lock.
+static u32 frame_victim(TieredAllocator *ta, u32 set) {
+    CxlFramePool *fp = &ta->cxl_frames;
+    u32 base = set * CXL_FRAME_WAYS;
+
+    for (u32 step = 0; step < 2 * CXL_FRAME_WAYS; ++step) {
+        u32 f = base + fp->hands[set];
+        CxlFrame *frame = fp->frames + f;
+        fp->hands[set] = (fp->hands[set] + 1) % CXL_FRAME_WAYS;
+
+        if (frame->pins > 0)
+            continue;
+        if (frame->ref && frame->chunk != NIL_CHUNK) {
+            frame->ref = false;
+            continue;
+        }
+        return f;
+    }
+
+    return NIL_FRAME;
+}
+
+// Pins the frame of chunk_num, loading the chunk into a replaced frame on a
+// miss. Without fill the chunk's contents are about to be overwritten and
+// are not decompressed. Returns NIL_FRAME when every frame of the set is
+// pinned.
+static u32 frame_pin(TieredAllocator *ta, u64 chunk_num, bool fill) {
+    CxlFramePool *fp = &ta->cxl_frames;
+    if (fp->num_sets == 0)
+        return NIL_FRAME;
+
+    u32 set = chunk_num % fp->num_sets;
+
+    pthread_mutex_lock(fp->locks + set);
+    u32 f = fp->frame_of[chunk_num];
+
+    if (f != NIL_FRAME) {
+        fp->frames[f].pins += 1;
+        fp->frames[f].ref = true;
+        __atomic_fetch_add(&fp->hits, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(fp->locks + set);
+        return f;
+    }
+
+    f = frame_victim(ta, set);
+
+    if (f != NIL_FRAME) {
+        CxlFrame *frame = fp->frames + f;
+        if (frame->chunk != NIL_CHUNK) {
+            if (frame->dirty)
+                frame_write_back(ta, f);
+            fp->frame_of[frame->chunk] = NIL_FRAME;
+        }
+
+        frame->chunk = chunk_num;
+        frame->pins = 1;
+        frame->ref = true;
+        frame->dirty = false;
+        fp->frame_of[chunk_num] = f;
+
+        if (fill) {
+            void *payload = ta->cxl_payload[chunk_num];
+            codec_decompress(ta, chunk_num, payload, frame_data(ta, f));
+        }
+
+        __atomic_fetch_add(&fp->misses, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(fp->locks + set);
+    return f;
+}
+
+static void frame_unpin(TieredAllocator *ta, u64 chunk_num, bool dirty) {
+    CxlFramePool *fp = &ta->cxl_frames;
+    u32 set = chunk_num % fp->num_sets;
+    u32 f = fp->frame_of[chunk_num];
+
+    pthread_mutex_lock(fp->locks + set);
+    fp->frames[f].pins -= 1;
+    fp->frames[f].dirty |= dirty;
+    pthread_mutex_unlock(fp->locks + set);
 }
 
-static void mp_destroy(MemoryPool *mp, void *ptr) {
-    void *next = mp->free_list;
-    mp->free_list = ptr;
-    *mp->free_list = next;
+// The chunk is being freed, so its frame is dropped without a write-back
+static void frame_drop(TieredAllocator *ta, u64 chunk_num) {
+    CxlFramePool *fp = &ta->cxl_frames;
+    if (fp->num_sets == 0)
+        return;
+
+    u32 set = chunk_num % fp->num_sets;
+
+    pthread_mutex_lock(fp->locks + set);
+    u32 f = fp->frame_of[chunk_num];
+    if (f != NIL_FRAME) {
+        fp->frames[f] = (CxlFrame) {NIL_CHUNK, 0, false, false};
+        fp->frame_of[chunk_num] = NIL_FRAME;
+    }
+    pthread_mutex_unlock(fp->locks + set);
 }
 
-static void mp_init(MemoryPool *mp, u64 size, u64 chunk_size, void *pool) {
-    mp->free_list = NULL;
-    for (u64 offset = chunk_size; offset < size; offset += chunk_size)
-        mp_destroy(mp, pool + offset - chunk_size);
+// Frees the pool, first writing back dirty frames if asked to
+static void frames_deinit(TieredAllocator *ta, bool write_back) {
+    CxlFramePool *fp = &ta->cxl_frames;
+    u32 num_frames = fp->num_sets * CXL_FRAME_WAYS;
+
+    for (u32 f = 0; f < num_frames; ++f) {
+        ASSERT(fp->frames[f].pins == 0);
+        if (write_back && fp->frames[f].dirty)
+            frame_write_back(ta, f);
+    }
+
+    for (u32 set = 0; set < fp->num_sets; ++set)
+        pthread_mutex_destroy(fp->locks + set);
+
+    free(fp->data);
+    free(fp->frames);
+    free(fp->frame_of);
+    free(fp->hands);
+    free(fp->locks);
+    fp->num_sets = 0;
+}
+
+static void frames_init(TieredAllocator *ta, u32 frames) {
+    CxlFramePool *fp = &ta->cxl_frames;
+    u64 num_chunks = ta->cap / chunk_bound(ta->chunk_size);
+
+    fp->num_sets = (frames + CXL_FRAME_WAYS - 1) / CXL_FRAME_WAYS;
+    u32 num_frames = fp->num_sets * CXL_FRAME_WAYS;
+
+    fp->data = malloc((u64) num_frames * ta->chunk_size);
+    fp->frames = malloc(num_frames * sizeof(*fp->frames));
+    fp->frame_of = malloc(num_chunks * sizeof(*fp->frame_of));
+    fp->hands = calloc(fp->num_sets, sizeof(*fp->hands));
+    fp->locks = malloc(fp->num_sets * sizeof(*fp->locks));
+    ASSERT(fp->data);
+    ASSERT(fp->frames);
+    ASSERT(fp->frame_of);
+    ASSERT(fp->hands);
+    ASSERT(fp->locks);
+
+    for (u32 f = 0; f < num_frames; ++f)
+        fp->frames[f] = (CxlFrame) {NIL_CHUNK, 0, false, false};
+    for (u64 i = 0; i < num_chunks; ++i)
+        fp->frame_of[i] = NIL_FRAME;
+    for (u32 set = 0; set < fp->num_sets; ++set)
+        ASSERT(pthread_mutex_init(fp->locks + set, NULL) == 0);
 }
 
 u64 chunk_bound(u64 chunk_size) {
     return align_u64(LZ4_compressBound(chunk_size));
 }
 
-void ta_init(TieredAllocator *ta, u64 chunk_size, u64 num_chunks) {
+// Sets up an allocator over an open backing file. The SSD chunks set in
+// ssd_used, if given, start out allocated.
+static void ta_setup(
+    TieredAllocator *ta, int fd, u64 chunk_size, u64 num_chunks,
+    const u64 *ssd_used
+) {
     u64 chunk_cap = chunk_bound(chunk_size);
     u64 cap = chunk_cap * num_chunks;
 
     ta->cap = cap;
     ta->chunk_size = chunk_size;
-    ta->backing_fd = open("/var/tmp/ssd", O_CREAT | O_RDWR | O_TRUNC, 0666);
-    ASSERT(ta->backing_fd != -1);
-    ASSERT(ftruncate(ta->backing_fd, cap) == 0);
+    ta->backing_fd = fd;
+    ta->manifest = NULL;
+    ta->manifest_size = 0;
+    ta->persist_offset = 0;
+    ta->persist_size = 0;
 
-    ta->cxl_scratch = malloc(chunk_cap);
+    // CXL chunks live in slabs, their offsets only number them
     ta->buffers[TIER_RAM] = malloc(cap);
-    ta->buffers[TIER_CXL] = malloc(cap);
-    ta->buffers[TIER_SSD] =
-        mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, ta->backing_fd, 0);
+    ta->buffers[TIER_CXL] = NULL;
+    ta->ssd_backend = SSD_MMAP;
+    ta->ssd_frames = NULL;
+    ssd_mmap_init(ta);
 
-    ASSERT(ta->cxl_scratch);
     ASSERT(ta->buffers[TIER_RAM]);
-    ASSERT(ta->buffers[TIER_CXL]);
-    ASSERT(ta->buffers[TIER_SSD] != MAP_FAILED);
 
     for (u8 t = 0; t < NUM_TIERS; ++t) {
-        ta->borrowed[t] = calloc(num_chunks, sizeof(*ta->borrowed));
+        ta->borrowed[t] = calloc(num_chunks, sizeof(*ta->borrowed[t]));
         ASSERT(ta->borrowed[t]);
-        mp_init(ta->pools + t, cap, chunk_cap, ta->buffers[t]);
+        mp_init(ta->pools + t, num_chunks, t == TIER_SSD ? ssd_used : NULL);
     }
 
+    ta->id = __atomic_fetch_add(&next_ta_id, 1, __ATOMIC_RELAXED);
+    ta->caches = NULL;
+    memset(ta->retired, 0, sizeof(ta->retired));
+    memset(&ta->retired_stats, 0, sizeof(ta->retired_stats));
+
+    sa_init(&ta->cxl_slabs, chunk_size, ta->memory_usage + TIER_CXL);
+    ta->cxl_payload = calloc(num_chunks, sizeof(*ta->cxl_payload));
+    ta->cxl_work = calloc(num_chunks, sizeof(*ta->cxl_work));
     ta->cxl_usage = calloc(num_chunks, sizeof (*ta->cxl_usage));
+    ta->cxl_codec = calloc(num_chunks, sizeof (*ta->cxl_codec));
+    ta->cxl_dict = calloc(num_chunks, sizeof (*ta->cxl_dict));
+    ASSERT(ta->cxl_payload);
+    ASSERT(ta->cxl_work);
     ASSERT(ta->cxl_usage);
+    ASSERT(ta->cxl_codec);
+    ASSERT(ta->cxl_dict);
+    ta->codec = CODEC_LZ4;
+    ta->codec_level = 0;
+    memset(&ta->adaptive, 0, sizeof(ta->adaptive));
+    memset(ta->codec_uses, 0, sizeof(ta->codec_uses));
+
+    ta->dict_current = 0;
+    ta->dict_count = 1;
+    ta->dict_ring = NULL;
+    ta->dict_ticks = 0;
+    ASSERT(pthread_mutex_init(&ta->dict_lock, NULL) == 0);
+    memset(&ta->cxl_frames, 0, sizeof(ta->cxl_frames));
     memset(ta->memory_usage, 0, sizeof (ta->memory_usage));
+
+    u64 ssd_free = ta->pools[TIER_SSD].free;
+    ta->memory_usage[TIER_SSD] = (num_chunks - ssd_free) * chunk_size;
+}
+
+void ta_init(TieredAllocator *ta, u64 chunk_size, u64 num_chunks) {
+    ta_init_at(ta, SSD_DEFAULT_PATH, chunk_size, num_chunks);
+}
+
+void ta_init_at(
+    TieredAllocator *ta, const char *path, u64 chunk_size, u64 num_chunks
+) {
+    u64 cap = chunk_bound(chunk_size) * num_chunks;
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    ASSERT(fd != -1);
+    ASSERT(ftruncate(fd, SSD_DATA_OFFSET + cap) == 0);
+
+    ta_setup(ta, fd, chunk_size, num_chunks, NULL);
+}
+
+static u64 manifest_hash(const void *manifest, u64 size) {
+    u64 hash[2];
+    MurmurHash3_x64_128(manifest, size, SSD_VERSION, hash);
+    return hash[0];
+}
+
+static void superblock_write(int fd, const SsdSuperblock *sb) {
+    ASSERT(pwrite(fd, sb, sizeof(*sb), 0) == sizeof(*sb));
+    ASSERT(fdatasync(fd) == 0);
+}
+
+// Reads and checks the superblock and manifest of a cleanly persisted file,
+// returning the manifest or NULL
+static u8 *manifest_read(int fd, SsdSuperblock *sb) {
+    if (pread(fd, sb, sizeof(*sb), 0) != sizeof(*sb))
+        return NULL;
+    if (sb->magic != SSD_MAGIC || sb->version != SSD_VERSION || !sb->clean)
+        return NULL;
+
+    u8 *manifest = malloc(sb->manifest_size);
+    ASSERT(manifest);
+
+    ssize_t n = pread(fd, manifest, sb->manifest_size, sb->manifest_offset);
+    if (n != (ssize_t) sb->manifest_size ||
+        manifest_hash(manifest, sb->manifest_size) != sb->manifest_hash) {
+        free(manifest);
+        return NULL;
+    }
+
+    return manifest;
+}
+
+bool ta_open(TieredAllocator *ta, const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+        return false;
+
+    SsdSuperblock sb;
+    u8 *manifest = manifest_read(fd, &sb);
+    if (manifest == NULL) {
+        close(fd);
+        return false;
+    }
+
+    u64 bitmap_size = (sb.num_chunks + 63) / 64 * sizeof(u64);
+    ta_setup(ta, fd, sb.chunk_size, sb.num_chunks, (u64 *) manifest);
+    ta->persist_offset = sb.manifest_offset;
+    ta->persist_size = sb.manifest_size;
+
+    ta->manifest_size = sb.manifest_size - bitmap_size;
+    ta->manifest = malloc(ta->manifest_size);
+    ASSERT(ta->manifest_size == 0 || ta->manifest);
+    memcpy(ta->manifest, manifest + bitmap_size, ta->manifest_size);
+    free(manifest);
+    return true;
+}
+
+static void bit_clear(u64 *bits, u64 i) {
+    bits[i >> 6] &= ~(1ULL << (i & 63));
+}
+
+void ta_ssd_used(TieredAllocator *ta, u64 *used) {
+    u64 num_chunks = ta->cap / chunk_bound(ta->chunk_size);
+    memset(used, 0xff, (num_chunks + 63) / 64 * sizeof(u64));
+
+    // Every SSD chunk is allocated unless the shared pool or a thread's
+    // magazine holds it
+    MemoryPool *mp = ta->pools + TIER_SSD;
+    for (u32 c = (u32) mp->head; c != NIL_CHUNK; c = mp->next[c])
+        bit_clear(used, c);
+
+    pthread_mutex_lock(&registry_lock);
+    for (ThreadCache *cache = ta->caches; cache; cache = cache->next) {
+        Magazine *mag = cache->mags + TIER_SSD;
+        mag_lock(mag);
+        for (u32 k = 0; k < mag->count; ++k)
+            bit_clear(used, mag->chunks[k]);
+        mag_unlock(mag);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void ta_persist(TieredAllocator *ta, const void *client, u64 size) {
+    u64 num_chunks = ta->cap / chunk_bound(ta->chunk_size);
+    u64 bitmap_size = (num_chunks + 63) / 64 * sizeof(u64);
+    u64 manifest_size = bitmap_size + size;
+    u8 *manifest = malloc(manifest_size);
+    ASSERT(manifest);
+
+    ta_ssd_used(ta, (u64 *) manifest);
+    memcpy(manifest + bitmap_size, client, size);
+    ta_sync(ta);
+
+    // The manifest the superblock points at has to survive until the new one
+    // is on disk, so the new one goes after it unless it fits before
+    u64 at = ssd_offset(ta, num_chunks);
+    if (ta->persist_size > 0 && at + manifest_size > ta->persist_offset)
+        at = ta->persist_offset + ta->persist_size;
+
+    ssize_t n = pwrite(ta->backing_fd, manifest, manifest_size, at);
+    ASSERT(n == (ssize_t) manifest_size);
+    ASSERT(fdatasync(ta->backing_fd) == 0);
+
+    SsdSuperblock sb = {
+        .magic = SSD_MAGIC,
+        .version = SSD_VERSION,
+        .clean = true,
+        .chunk_size = ta->chunk_size,
+        .num_chunks = num_chunks,
+        .manifest_offset = at,
+        .manifest_size = manifest_size,
+        .manifest_hash = manifest_hash(manifest, manifest_size),
+    };
+    superblock_write(ta->backing_fd, &sb);
+    ta->persist_offset = at;
+    ta->persist_size = manifest_size;
+    free(manifest);
 }
 
 void ta_deinit(TieredAllocator *ta) {
@@ -72,33 +1434,67 @@ void ta_deinit(TieredAllocator *ta) {
 
     for (u8 t = 0; t < NUM_TIERS; ++t) {
         for (u64 i = 0; i < num_chunks; ++i)
-            ASSERT(!ta->borrowed[t][i]);
+            ASSERT(ta->borrowed[t][i] == BORROW_NONE);
 
         free(ta->borrowed[t]);
     }
 
+    // Chunks still cached by live threads go away with the buffers
+    pthread_mutex_lock(&registry_lock);
+    for (ThreadCache *cache = ta->caches; cache; cache = cache->next)
+        cache->ta = NULL;
+    pthread_mutex_unlock(&registry_lock);
+
+    for (u8 t = 0; t < NUM_TIERS; ++t)
+        free(ta->pools[t].next);
+
+    if (ta->cxl_frames.num_sets > 0)
+        frames_deinit(ta, false);
+
+    for (u32 d = 1; d < ta->dict_count; ++d) {
+        free(ta->dicts[d].data);
+        LZ4_freeStream(ta->dicts[d].stream);
+    }
+    free(ta->dict_ring);
+    pthread_mutex_destroy(&ta->dict_lock);
+
+    for (u64 i = 0; i < num_chunks; ++i) {
+        if (ta->cxl_payload[i])
+            sa_free(&ta->cxl_slabs, ta->cxl_payload[i]);
+    }
+    sa_deinit(&ta->cxl_slabs);
+
+    free(ta->manifest);
+    free(ta->cxl_payload);
+    free(ta->cxl_work);
     free(ta->cxl_usage);
-    free(ta->cxl_scratch);
+    free(ta->cxl_codec);
+    free(ta->cxl_dict);
     free(ta->buffers[TIER_RAM]);
-    free(ta->buffers[TIER_CXL]);
-    ASSERT(munmap(ta->buffers[TIER_SSD], ta->cap) != -1);
+    if (ta->ssd_backend == SSD_PIO)
+        ssd_pio_deinit(ta);
+    else
+        ASSERT(munmap(ta->buffers[TIER_SSD], ta->cap) != -1);
     ASSERT(close(ta->backing_fd) != -1);
 }
 
 Ptr ta_create(TieredAllocator *ta, MemoryTier tier) {
-    void *buf = mp_create(ta->pools + tier);
-    u64 offset = buf - ta->buffers[tier];
     u64 chunk_cap = chunk_bound(ta->chunk_size);
-    u64 chunk_num = offset / chunk_cap;
+    u64 chunk_num = cache_pop(ta, tier);
+    u64 offset = chunk_num * chunk_cap;
     Ptr ptr = ((u64) tier << 62) | offset;
 
     if (tier == TIER_CXL) {
-        ta->borrowed[tier][chunk_num] = true;
+        u32 f = frame_pin(ta, chunk_num, false);
+        void *buf = f != NIL_FRAME ? frame_data(ta, f)
+                                   : cxl_work_alloc(ta, chunk_num);
+
+        ta->borrowed[tier][chunk_num] = BORROW_WRITE;
         memset(buf, 0, ta->chunk_size);
         ta_flush(ta, ptr);
     }
     else {
-        ta->memory_usage[tier] += ta->chunk_size;
+        usage_add(ta, tier, ta->chunk_size);
     }
 
     return ptr;
@@ -112,25 +1508,37 @@ void ta_destroy(TieredAllocator *ta, Ptr ptr) {
 
     ASSERT(tier < NUM_TIERS);
 
-    ta->borrowed[tier][chunk_num] = false;
+    if (is_thread_reader(ta, ptr))
+        thread_state_ptr->reader = null_ptr();
+    ta->borrowed[tier][chunk_num] = BORROW_NONE;
+
+    if (is_ssd_pio(ta, tier))
+        ssd_pio_destroy(ta, chunk_num);
+    else if (tier == TIER_CXL)
+        frame_drop(ta, chunk_num);
 
     if (tier == TIER_CXL) {
-        ta->memory_usage[tier] -= ta->cxl_usage[chunk_num];
+        free(ta->cxl_work[chunk_num]);
+        ta->cxl_work[chunk_num] = NULL;
+        if (ta->cxl_payload[chunk_num])
+            sa_free(&ta->cxl_slabs, ta->cxl_payload[chunk_num]);
+        ta->cxl_payload[chunk_num] = NULL;
         ta->cxl_usage[chunk_num] = 0;
     }
     else {
-        ta->memory_usage[tier] -= ta->chunk_size;
+        usage_add(ta, tier, -ta->chunk_size);
     }
 
-    mp_destroy(ta->pools + tier, ta->buffers[tier] + offset);
+    cache_push(ta, tier, chunk_num);
 }
 
 Ptr ta_migrate(TieredAllocator *ta, Ptr src_ptr, MemoryTier tier) {
     Ptr dst_ptr = ta_create(ta, tier);
-    void *src = ta_acquire(ta, src_ptr);
+    void *src = ta_acquire_read(ta, src_ptr);
     void *dst = ta_acquire(ta, dst_ptr);
     memcpy(dst, src, ta->chunk_size);
     ta_destroy(ta, src_ptr);
+    stat_add(&thread_stats(ta)->tiers[tier].migrations, 1);
     return dst_ptr;
 }
 
@@ -142,23 +1550,42 @@ void *ta_acquire(TieredAllocator *ta, Ptr ptr) {
     void *p = ta->buffers[tier] + offset;
 
     ASSERT(tier < NUM_TIERS);
-    ASSERT(!ta->borrowed[tier][chunk_num]);
-    ta->borrowed[tier][chunk_num] = true;
+    ASSERT(ta->borrowed[tier][chunk_num] == BORROW_NONE);
+    ta->borrowed[tier][chunk_num] = BORROW_WRITE;
+    u64 start;
+    TaStats *stats = sample_begin(ta, &start);
 
     switch (tier) {
     case TIER_RAM:
         break;
-    case TIER_CXL:
-        LZ4_decompress_safe(p, ta->cxl_scratch, chunk_cap, chunk_cap);
-        memcpy(p, ta->cxl_scratch, ta->chunk_size);
+    case TIER_CXL: {
+        u32 f = frame_pin(ta, chunk_num, true);
+        if (f != NIL_FRAME) {
+            p = frame_data(ta, f);
+            break;
+        }
+
+        // Raw chunks are already usable in place
+        p = ta->cxl_payload[chunk_num];
+        if (ta->cxl_codec[chunk_num] == CODEC_RAW)
+            break;
+
+        void *work = cxl_work_alloc(ta, chunk_num);
+        codec_decompress(ta, chunk_num, p, work);
+        p = work;
         break;
+    }
     case TIER_SSD:
-        madvise(p, chunk_cap, MADV_DONTNEED);
+        if (ta->ssd_backend == SSD_PIO)
+            p = ssd_pio_acquire(ta, chunk_num);
+        else
+            madvise(p, chunk_cap, MADV_DONTNEED);
         break;
     default:
         break;
     }
 
+    acquire_done(stats, tier, start);
     return p;
 }
 
@@ -167,6 +1594,115 @@ void *ta_acquire_raw(TieredAllocator *ta, Ptr ptr) {
     u64 offset = (ptr << 2) >> 2;
     void *p = ta->buffers[tier] + offset;
 
+    u64 chunk_num = offset / chunk_bound(ta->chunk_size);
+
+    if (is_thread_reader(ta, ptr))
+        return thread_state_ptr->read_scratch;
+    if (is_ssd_pio(ta, tier))
+        return ta->ssd_frames[chunk_num];
+    if (tier == TIER_CXL && frame_of(ta, chunk_num) != NIL_FRAME)
+        return frame_data(ta, frame_of(ta, chunk_num));
+    if (tier == TIER_CXL && ta->cxl_work[chunk_num])
+        return ta->cxl_work[chunk_num];
+    if (tier == TIER_CXL)
+        return ta->cxl_payload[chunk_num];
+    return p;
+}
+
+void *ta_acquire_read(TieredAllocator *ta, Ptr ptr) {
+    MemoryTier tier = get_tier(ptr);
+    u64 offset = (ptr << 2) >> 2;
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+    u64 chunk_num = offset / chunk_cap;
+    void *p = ta->buffers[tier] + offset;
+
+    ASSERT(tier < NUM_TIERS);
+    ASSERT(ta->borrowed[tier][chunk_num] == BORROW_NONE);
+    ta->borrowed[tier][chunk_num] = BORROW_READ;
+    u64 start;
+    TaStats *stats = sample_begin(ta, &start);
+
+    switch (tier) {
+    case TIER_RAM:
+        break;
+    case TIER_CXL: {
+        u32 f = frame_pin(ta, chunk_num, true);
+        if (f != NIL_FRAME) {
+            p = frame_data(ta, f);
+            break;
+        }
+
+        p = ta->cxl_payload[chunk_num];
+        if (ta->cxl_codec[chunk_num] == CODEC_RAW)
+            break;
+
+        // The compressed bytes stay in place so that a release is free
+        ThreadState *ts = thread_scratch(ta);
+        ASSERT(is_null_ptr(ts->reader));
+        ts->reader_ta = ta;
+        ts->reader = ptr;
+        codec_decompress(ta, chunk_num, p, ts->read_scratch);
+        p = ts->read_scratch;
+        break;
+    }
+    case TIER_SSD:
+        if (ta->ssd_backend == SSD_PIO)
+            p = ssd_pio_acquire(ta, chunk_num);
+        else
+            madvise(p, chunk_cap, MADV_DONTNEED);
+        break;
+    default:
+        break;
+    }
+
+    acquire_done(stats, tier, start);
+    return p;
+}
+
+void ta_release(TieredAllocator *ta, Ptr ptr) {
+    MemoryTier tier = get_tier(ptr);
+    u64 offset = (ptr << 2) >> 2;
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+    u64 chunk_num = offset / chunk_cap;
+
+    ASSERT(tier < NUM_TIERS);
+    ASSERT(ta->borrowed[tier][chunk_num] == BORROW_READ);
+    ta->borrowed[tier][chunk_num] = BORROW_NONE;
+
+    if (tier == TIER_CXL && frame_of(ta, chunk_num) != NIL_FRAME)
+        frame_unpin(ta, chunk_num, false);
+    else if (is_thread_reader(ta, ptr))
+        thread_state_ptr->reader = null_ptr();
+    else if (is_ssd_pio(ta, tier))
+        ssd_pio_release(ta, chunk_num);
+}
+
+void *ta_upgrade(TieredAllocator *ta, Ptr ptr) {
+    MemoryTier tier = get_tier(ptr);
+    u64 offset = (ptr << 2) >> 2;
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+    u64 chunk_num = offset / chunk_cap;
+    void *p = ta->buffers[tier] + offset;
+
+    ASSERT(tier < NUM_TIERS);
+    ASSERT(ta->borrowed[tier][chunk_num] == BORROW_READ);
+    ta->borrowed[tier][chunk_num] = BORROW_WRITE;
+
+    if (tier == TIER_CXL && frame_of(ta, chunk_num) != NIL_FRAME) {
+        p = frame_data(ta, frame_of(ta, chunk_num));
+    }
+    else if (is_thread_reader(ta, ptr)) {
+        p = cxl_work_alloc(ta, chunk_num);
+        memcpy(p, thread_state_ptr->read_scratch, ta->chunk_size);
+        thread_state_ptr->reader = null_ptr();
+    }
+    else if (tier == TIER_CXL) {
+        p = ta->cxl_payload[chunk_num];
+    }
+    else if (is_ssd_pio(ta, tier)) {
+        p = ta->ssd_frames[chunk_num];
+    }
+
     return p;
 }
 
@@ -178,25 +1714,161 @@ void ta_flush(TieredAllocator *ta, Ptr ptr) {
     void *p = ta->buffers[tier] + offset;
 
     ASSERT(tier < NUM_TIERS);
-    ASSERT(ta->borrowed[tier][chunk_num]);
-    ta->borrowed[tier][chunk_num] = false;
+    ASSERT(ta->borrowed[tier][chunk_num] == BORROW_WRITE);
+    ta->borrowed[tier][chunk_num] = BORROW_NONE;
+    u64 start;
+    TaStats *stats = sample_begin(ta, &start);
 
     switch (tier) {
     case TIER_RAM:
         break;
-    case TIER_CXL:
-        ta->memory_usage[tier] -= ta->cxl_usage[chunk_num];
-        ta->cxl_usage[chunk_num] =
-            LZ4_compress_default(p, ta->cxl_scratch, ta->chunk_size, chunk_cap);
-        memcpy(p, ta->cxl_scratch, chunk_cap);
-        ta->memory_usage[tier] += ta->cxl_usage[chunk_num];
+    case TIER_CXL: {
+        // Compression is deferred until the frame is replaced
+        if (frame_of(ta, chunk_num) != NIL_FRAME) {
+            frame_unpin(ta, chunk_num, true);
+            break;
+        }
+
+        // Raw chunks were edited in place
+        ThreadState *ts = thread_scratch(ta);
+        void *work = ta->cxl_work[chunk_num];
+        void *src = work ? work : ta->cxl_payload[chunk_num];
+        u32 usage = codec_compress(ta, src, ts->scratch, chunk_num);
+        cxl_store(ta, chunk_num, ts->scratch, usage);
+        free(work);
+        ta->cxl_work[chunk_num] = NULL;
         break;
+    }
     case TIER_SSD:
-        msync(p, chunk_cap, MS_SYNC);
+        if (ta->ssd_backend == SSD_PIO)
+            ssd_pio_flush(ta, chunk_num);
+        else
+            msync(p, chunk_cap, MS_SYNC);
         break;
     default:
         break;
     }
+
+    flush_done(stats, tier, start);
+}
+
+void ta_set_ssd_backend(TieredAllocator *ta, SsdBackend backend) {
+    u64 num_chunks = ta->cap / chunk_bound(ta->chunk_size);
+    for (u64 i = 0; i < num_chunks; ++i)
+        ASSERT(ta->borrowed[TIER_SSD][i] == BORROW_NONE);
+
+    if (backend == ta->ssd_backend)
+        return;
+
+    if (backend == SSD_PIO) {
+        ASSERT(munmap(ta->buffers[TIER_SSD], ta->cap) != -1);
+        ssd_pio_init(ta);
+    }
+    else {
+        ssd_pio_deinit(ta);
+        ssd_mmap_init(ta);
+    }
+
+    ta->ssd_backend = backend;
+}
+
+void ta_set_codec(TieredAllocator *ta, Codec codec, int level) {
+    ASSERT(codec <= CODEC_ADAPTIVE);
+    ta->codec = codec;
+    ta->codec_level = level;
+}
+
+void ta_enable_dict(TieredAllocator *ta, u32 dict_size) {
+    dict_size -= dict_size % ta->chunk_size;
+    ASSERT(dict_size > 0 && dict_size <= DICT_MAX_SIZE);
+    ASSERT(ta->dict_ring == NULL);
+
+    ta->dict_ring = malloc(dict_size);
+    ASSERT(ta->dict_ring);
+    ta->dict_size = dict_size;
+    ta->dict_pos = 0;
+    ta->dict_wraps = 0;
+    ta->dict_full = false;
+}
+
+bool ta_train_dict(TieredAllocator *ta) {
+    pthread_mutex_lock(&ta->dict_lock);
+
+    u32 size = ta->dict_full ? ta->dict_size : ta->dict_pos;
+    if (ta->dict_ring == NULL || size == 0 || ta->dict_count == MAX_DICTS) {
+        pthread_mutex_unlock(&ta->dict_lock);
+        return false;
+    }
+
+    // Oldest samples first, leaving the newest nearest the data compressed
+    CxlDict *dict = ta->dicts + ta->dict_count;
+    u32 tail = size - ta->dict_pos;
+    dict->data = malloc(size);
+    ASSERT(dict->data);
+    memcpy(dict->data, ta->dict_ring + ta->dict_pos, tail);
+    memcpy(dict->data + tail, ta->dict_ring, ta->dict_pos);
+    dict->size = size;
+
+    dict->stream = LZ4_createStream();
+    ASSERT(dict->stream);
+    LZ4_loadDict(dict->stream, dict->data, size);
+
+    __atomic_store_n(&ta->dict_current, ta->dict_count, __ATOMIC_RELEASE);
+    ta->dict_count += 1;
+
+    pthread_mutex_unlock(&ta->dict_lock);
+    return true;
+}
+
+void ta_set_cxl_frames(TieredAllocator *ta, u32 frames) {
+    if (ta->cxl_frames.num_sets > 0)
+        frames_deinit(ta, true);
+    if (frames > 0)
+        frames_init(ta, frames);
+}
+
+void ta_sync(TieredAllocator *ta) {
+    SsdWriteback *wb = &ta->ssd_wb;
+
+    // Mapped chunks are already synced on every flush
+    if (ta->ssd_backend == SSD_MMAP)
+        return;
+
+    pthread_mutex_lock(&wb->lock);
+    while (wb->queue_len > 0 || wb->writing)
+        pthread_cond_wait(&wb->idle, &wb->lock);
+    pthread_mutex_unlock(&wb->lock);
+
+    ASSERT(fdatasync(ta->backing_fd) == 0);
+}
+
+void ta_prefetch(TieredAllocator *ta, Ptr ptr) {
+    u64 offset = (ptr << 2) >> 2;
+    u64 chunk_cap = chunk_bound(ta->chunk_size);
+
+    if (get_tier(ptr) != TIER_SSD)
+        return;
+
+    if (ta->ssd_backend == SSD_PIO) {
+        SsdWriteback *wb = &ta->ssd_wb;
+        u64 chunk_num = offset / chunk_cap;
+        pthread_mutex_lock(&wb->lock);
+
+        // Chunks with a write-back or read of their own are left alone
+        bool wanted = !wb->reads[chunk_num] && !wb->prefetched[chunk_num] &&
+                      !wb->pending[chunk_num] && !wb->inflight[chunk_num] &&
+                      wb->num_prefetched + wb->read_len < SSD_PREFETCH_MAX;
+        if (wanted) {
+            wb->reads[chunk_num] = READ_QUEUED;
+            wb->read_queue[wb->read_len++] = chunk_num;
+            pthread_cond_signal(&wb->read_wake);
+        }
+
+        pthread_mutex_unlock(&wb->lock);
+    }
+    else {
+        madvise(ta->buffers[TIER_SSD] + offset, chunk_cap, MADV_WILLNEED);
+    }
 }
 
 bool ta_ptr_valid(TieredAllocator *ta, Ptr ptr) {
@@ -209,6 +1881,38 @@ bool ta_ptr_valid(TieredAllocator *ta, Ptr ptr) {
     return tier < NUM_TIERS && chunk_num < num_chunks;
 }
 
+u64 ta_memory_usage(TieredAllocator *ta, MemoryTier tier) {
+    return __atomic_load_n(ta->memory_usage + tier, __ATOMIC_RELAXED);
+}
+
+void ta_stats(TieredAllocator *ta, TaStats *stats) {
+    pthread_mutex_lock(&registry_lock);
+
+    *stats = ta->retired_stats;
+    for (ThreadCache *cache = ta->caches; cache; cache = cache->next)
+        ta_stats_fold(stats, &cache->stats);
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void ta_pool_stats(TieredAllocator *ta, MemoryTier tier, PoolStats *stats) {
+    pthread_mutex_lock(&registry_lock);
+
+    *stats = ta->retired[tier];
+    for (ThreadCache *cache = ta->caches; cache; cache = cache->next) {
+        Magazine *mag = cache->mags + tier;
+        stats_fold(stats, mag);
+        stats->cached += __atomic_load_n(&mag->count, __ATOMIC_RELAXED);
+    }
+    stats->free = __atomic_load_n(&ta->pools[tier].free, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void *ta_thread_scratch(TieredAllocator *ta) {
+    return thread_scratch(ta)->client_scratch;
+}
+
 MemoryTier get_tier(Ptr ptr) {
     return ptr >> 62;
 }
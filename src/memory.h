@@ -1,7 +1,12 @@
 #ifndef MEMORY_H_
 #define MEMORY_H_
 
+#include <pthread.h>
+
 #include "common.h"
+#include "slab.h"
+
+typedef u64 Ptr;
 
 typedef enum {
     TIER_RAM = 0,
@@ -10,10 +15,145 @@ typedef enum {
     NUM_TIERS = 3,
 } MemoryTier;
 
+typedef enum {
+    BORROW_NONE = 0,
+    BORROW_READ = 1,
+    BORROW_WRITE = 2,
+} BorrowState;
+
+// Codecs a CXL chunk can be stored with. CODEC_ADAPTIVE is only a policy
+// that picks one of the others per chunk.
+typedef enum {
+    CODEC_RAW = 0,
+    CODEC_LZ4 = 1,
+    CODEC_LZ4HC = 2,
+    NUM_CODECS = 3,
+    CODEC_ADAPTIVE = NUM_CODECS,
+} Codec;
+
+// Running averages over sampled chunks compressed with both LZ4 and LZ4HC
 typedef struct {
-    void **free_list;
+    u32 ticks;
+    bool use_hc;
+    u64 lz4_size;
+    u64 hc_size;
+    u64 lz4_ns;
+    u64 hc_ns;
+} AdaptiveCodec;
+
+// A published dictionary never changes, so chunks compressed against it stay
+// readable after newer versions replace it. The stream has it preloaded.
+typedef struct {
+    char *data;
+    u32 size;
+    void *stream;
+} CxlDict;
+
+#define MAX_DICTS 256
+
+typedef enum {
+    SSD_MMAP = 0,
+    SSD_PIO = 1,
+} SsdBackend;
+
+// I/O state of the pread/pwrite SSD backend. A flushed chunk becomes pending
+// and is written by a background thread, so repeated flushes of a chunk
+// coalesce into one write and runs of adjacent chunks into one pwritev.
+// Prefetched chunks are read by another thread into frames that a later
+// acquire takes over, waiting for the read if it is running. Frames are
+// recycled through `spare`.
+typedef struct {
+    void **pending;
+    void **inflight;
+    u8 *queued;
+    u32 *queue;
+    u64 queue_len;
+    bool writing;
+    bool stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+
+    void **prefetched;
+    u8 *reads;
+    u32 *read_queue;
+    u64 read_len;
+    u32 num_prefetched;
+    pthread_t reader;
+    pthread_cond_t read_wake;
+    pthread_cond_t read_done;
+
+    void **spare;
+    u32 num_spare;
+} SsdWriteback;
+
+typedef struct {
+    u32 chunk;
+    u32 pins;
+    bool ref;
+    bool dirty;
+} CxlFrame;
+
+// Decompressed copies of CXL chunks. A chunk may only live in one set of
+// CXL_FRAME_WAYS frames, picked by its number, and each set has its own lock
+// and clock hand. Dirty frames are compressed back when replaced.
+typedef struct {
+    u32 num_sets;
+    u8 *data;
+    CxlFrame *frames;
+    u32 *frame_of;
+    u32 *hands;
+    pthread_mutex_t *locks;
+    u64 hits;
+    u64 misses;
+    u64 writebacks;
+} CxlFramePool;
+
+// Lock-free stack of free chunk indices. The links live outside the chunks
+// so a stale pop never reads memory its new owner is writing, and the head
+// carries a tag in its upper half against ABA.
+typedef struct {
+    u64 head;
+    u32 *next;
+    u64 free;
 } MemoryPool;
 
+typedef struct {
+    u64 creates;
+    u64 destroys;
+    u64 refills;
+    u64 spills;
+    u64 cached;
+    u64 free;
+} PoolStats;
+
+#define LATENCY_BUCKETS 32
+
+// Activity on one tier. Latency is sampled on one acquire or flush in
+// 2^STATS_SAMPLE_SHIFT per thread, and bucket b of a histogram counts the
+// samples that took from 2^b up to 2^(b+1) ns. Migrations count chunks moved
+// into the tier.
+typedef struct {
+    u64 acquires;
+    u64 flushes;
+    u64 migrations;
+    u64 acquire_ns;
+    u64 acquire_hist[LATENCY_BUCKETS];
+    u64 flush_hist[LATENCY_BUCKETS];
+} TierStats;
+
+// Counters of one thread, or of every thread once summed by ta_stats. Only
+// u64 counters go here since they are summed as an array.
+typedef struct {
+    TierStats tiers[NUM_TIERS];
+    u64 compressed_in;
+    u64 compressed_out;
+    u64 decompressed;
+} TaStats;
+
+typedef struct ThreadCache ThreadCache;
+
 typedef struct {
     u64 cap;
     u64 chunk_size;
@@ -21,18 +161,69 @@ typedef struct {
     MemoryPool pools[3];
 
     int backing_fd;
-    void *cxl_scratch;
+    void *manifest;
+    u64 manifest_size;
+    u64 persist_offset;
+    u64 persist_size;
+    SsdBackend ssd_backend;
+    void **ssd_frames;
+    SsdWriteback ssd_wb;
+
+    u64 id;
+    ThreadCache *caches;
+    PoolStats retired[3];
+    TaStats retired_stats;
 
+    SlabAllocator cxl_slabs;
+    void **cxl_payload;
+    void **cxl_work;
     u32 *cxl_usage;
+    u8 *cxl_codec;
+    Codec codec;
+    int codec_level;
+    AdaptiveCodec adaptive;
+    u64 codec_uses[NUM_CODECS];
+
+    u8 *cxl_dict;
+    u8 dict_current;
+    u32 dict_count;
+    CxlDict dicts[MAX_DICTS];
+    pthread_mutex_t dict_lock;
+    u8 *dict_ring;
+    u32 dict_size;
+    u32 dict_pos;
+    u32 dict_wraps;
+    bool dict_full;
+    u32 dict_ticks;
+    CxlFramePool cxl_frames;
     u64 memory_usage[3];
-    bool *borrowed[3];
+    u8 *borrowed[3];
 } TieredAllocator;
 
-typedef u64 Ptr;
+#define STATS_SAMPLE_SHIFT 6
 
 extern const char *TIER_STRS[3];
 
 void ta_init(TieredAllocator *ta, u64 size, u64 chunk_size);
+// Like ta_init with the SSD tier backed by the file at path, which is
+// created or truncated
+void ta_init_at(
+    TieredAllocator *ta, const char *path, u64 chunk_size, u64 num_chunks
+);
+// Reattaches to a file written by ta_persist. The SSD chunks allocated then
+// are allocated again and read lazily on their first acquire, and the
+// client's bytes are in ta->manifest. Returns false when path holds no
+// cleanly persisted file.
+bool ta_open(TieredAllocator *ta, const char *path);
+// Makes the SSD tier durable and records which of its chunks are allocated,
+// along with `size` bytes of client state, in the file's manifest. RAM and
+// CXL chunks are not saved. Needs the allocator to be idle. The file opens
+// to this state until the next ta_persist, so the caller must neither write
+// nor destroy the recorded chunks before then if a crash should find them.
+void ta_persist(TieredAllocator *ta, const void *client, u64 size);
+// Sets the bit of every allocated SSD chunk in used, which holds one bit per
+// chunk, and clears the others. Needs the allocator to be idle.
+void ta_ssd_used(TieredAllocator *ta, u64 *used);
 void ta_deinit(TieredAllocator *ta);
 
 Ptr ta_create(TieredAllocator *ta, MemoryTier tier);
@@ -43,7 +234,61 @@ void *ta_acquire(TieredAllocator *ta, Ptr ptr);
 void ta_flush(TieredAllocator *ta, Ptr ptr);
 void *ta_acquire_raw(TieredAllocator *ta, Ptr ptr);
 
+// Read-only borrows skip the write-back on release. Each thread may hold one
+// read-borrowed CXL chunk at a time since it is decompressed into a
+// per-thread buffer. Borrows of distinct chunks may run on different threads;
+// callers serialize access to any single chunk.
+void *ta_acquire_read(TieredAllocator *ta, Ptr ptr);
+void ta_release(TieredAllocator *ta, Ptr ptr);
+void *ta_upgrade(TieredAllocator *ta, Ptr ptr);
+
+// Per-thread buffer of two chunk bounds for the caller, which no other call
+// of the allocator touches. It moves when the thread next asks for it with a
+// larger chunk size, and may only be asked for while no chunk is
+// read-borrowed.
+void *ta_thread_scratch(TieredAllocator *ta);
+
+// Selects how the SSD tier reaches the backing file: a shared mapping synced
+// on every flush, or explicit reads with asynchronous write-back and
+// read-ahead. May only be called while no SSD chunk is borrowed.
+void ta_set_ssd_backend(TieredAllocator *ta, SsdBackend backend);
+// Codec for CXL chunks compressed from now on, chunks keep the codec they
+// were written with. level is the LZ4 acceleration or the LZ4HC level, 0 for
+// the default. Any chunk that does not shrink is stored raw.
+void ta_set_codec(TieredAllocator *ta, Codec codec, int level);
+// Samples the chunks being compressed into a dict_size byte window (at most
+// 64KiB) and trains a dictionary once it has filled, retraining after 2, 4,
+// 8... refills. LZ4 compression, adaptive included, then runs against the
+// current dictionary.
+void ta_enable_dict(TieredAllocator *ta, u32 dict_size);
+// Publishes the sample window as a new dictionary version. Earlier versions
+// stay loaded for the chunks that use them, and false is returned once all
+// MAX_DICTS - 1 versions are taken.
+bool ta_train_dict(TieredAllocator *ta);
+// Caches up to `frames` decompressed CXL chunks (rounded up to whole sets) so
+// warm chunks are borrowed without a codec pass, 0 disables the cache. The
+// compressed size of a dirty frame is only accounted once it is written back.
+// May only be called while no CXL chunk is borrowed.
+void ta_set_cxl_frames(TieredAllocator *ta, u32 frames);
+// Waits for queued SSD write-back and makes it durable
+void ta_sync(TieredAllocator *ta);
+// Starts reading an SSD chunk ahead of its acquire. With SSD_PIO the read
+// runs on a background thread and the acquire takes its frame, otherwise the
+// kernel is asked to read ahead.
+void ta_prefetch(TieredAllocator *ta, Ptr ptr);
+
 bool ta_ptr_valid(TieredAllocator *ta, Ptr ptr);
+// CXL chunks are counted by the slabs holding their compressed bytes, so the
+// CXL usage includes the slack of partly used slabs
+u64 ta_memory_usage(TieredAllocator *ta, MemoryTier tier);
+
+// Counters of every thread cache of the allocator, including those of
+// threads that have exited, plus the chunks left in the shared pool
+void ta_pool_stats(TieredAllocator *ta, MemoryTier tier, PoolStats *stats);
+// Activity counters summed over every thread, including exited ones. Each
+// thread counts on its own, so this is cheap to leave on and the sum is
+// only consistent while the allocator is idle.
+void ta_stats(TieredAllocator *ta, TaStats *stats);
 
 MemoryTier get_tier(Ptr ptr);
 Ptr null_ptr();
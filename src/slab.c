@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "slab.h"
+
+#define SLAB_MIN_SIZE 4096
+#define SLAB_MIN_OBJECTS 8
+
+// Header at the start of every slab. Objects handed out once and freed since
+// are linked through their first bytes, the rest lie past bump.
+struct Slab {
+    SlabClass *cls;
+    Slab *prev;
+    Slab *next;
+    void *free;
+    u32 used;
+    u32 bump;
+};
+
+static u64 header_size() {
+    return (sizeof(Slab) + SLAB_GRAIN - 1) / SLAB_GRAIN * SLAB_GRAIN;
+}
+
+static void partial_link(SlabClass *cls, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = cls->partial;
+    if (cls->partial)
+        cls->partial->prev = slab;
+    cls->partial = slab;
+}
+
+static void partial_unlink(SlabClass *cls, Slab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cls->partial = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static Slab *slab_new(SlabAllocator *sa, SlabClass *cls) {
+    Slab *slab = aligned_alloc(sa->slab_size, sa->slab_size);
+    ASSERT(slab);
+    __atomic_fetch_add(sa->footprint, sa->slab_size, __ATOMIC_RELAXED);
+
+    slab->cls = cls;
+    slab->free = NULL;
+    slab->used = 0;
+    slab->bump = 0;
+    return slab;
+}
+
+static void slab_delete(SlabAllocator *sa, Slab *slab) {
+    free(slab);
+    __atomic_fetch_sub(sa->footprint, sa->slab_size, __ATOMIC_RELAXED);
+}
+
+u32 sa_class(u32 size) {
+    return (size + SLAB_GRAIN - 1) / SLAB_GRAIN;
+}
+
+void sa_init(SlabAllocator *sa, u32 max_size, u64 *footprint) {
+    sa->num_classes = sa_class(max_size);
+    sa->footprint = footprint;
+
+    u64 largest = (u64) sa->num_classes * SLAB_GRAIN;
+    sa->slab_size = SLAB_MIN_SIZE;
+    while (sa->slab_size < header_size() + SLAB_MIN_OBJECTS * largest)
+        sa->slab_size <<= 1;
+
+    sa->classes = malloc(sa->num_classes * sizeof(*sa->classes));
+    ASSERT(sa->classes);
+
+    for (u32 c = 0; c < sa->num_classes; ++c) {
+        SlabClass *cls = sa->classes + c;
+        cls->size = (c + 1) * SLAB_GRAIN;
+        cls->per_slab = (sa->slab_size - header_size()) / cls->size;
+        cls->partial = NULL;
+        cls->empty = NULL;
+        ASSERT(pthread_mutex_init(&cls->lock, NULL) == 0);
+    }
+}
+
+// Every object must have been freed
+void sa_deinit(SlabAllocator *sa) {
+    for (u32 c = 0; c < sa->num_classes; ++c) {
+        SlabClass *cls = sa->classes + c;
+        ASSERT(cls->partial == NULL);
+        if (cls->empty)
+            slab_delete(sa, cls->empty);
+        pthread_mutex_destroy(&cls->lock);
+    }
+
+    free(sa->classes);
+}
+
+void *sa_alloc(SlabAllocator *sa, u32 size) {
+    ASSERT(size > 0 && sa_class(size) <= sa->num_classes);
+    SlabClass *cls = sa->classes + sa_class(size) - 1;
+
+    pthread_mutex_lock(&cls->lock);
+    Slab *slab = cls->partial;
+    if (!slab) {
+        slab = cls->empty ? cls->empty : slab_new(sa, cls);
+        cls->empty = NULL;
+        partial_link(cls, slab);
+    }
+
+    void *p = slab->free;
+    if (p)
+        slab->free = *(void **) p;
+    else
+        p = (u8 *) slab + header_size() + (u64) slab->bump++ * cls->size;
+
+    if (++slab->used == cls->per_slab)
+        partial_unlink(cls, slab);
+    pthread_mutex_unlock(&cls->lock);
+
+    return p;
+}
+
+void sa_free(SlabAllocator *sa, void *p) {
+    Slab *slab = (Slab *) ((uintptr_t) p & ~((uintptr_t) sa->slab_size - 1));
+    SlabClass *cls = slab->cls;
+
+    pthread_mutex_lock(&cls->lock);
+    *(void **) p = slab->free;
+    slab->free = p;
+
+    if (slab->used-- == cls->per_slab)
+        partial_link(cls, slab);
+
+    if (slab->used == 0) {
+        partial_unlink(cls, slab);
+
+        if (cls->empty) {
+            slab_delete(sa, slab);
+        }
+        else {
+            slab->free = NULL;
+            slab->bump = 0;
+            cls->empty = slab;
+        }
+    }
+    pthread_mutex_unlock(&cls->lock);
+}
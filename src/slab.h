@@ -0,0 +1,43 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <pthread.h>
+
+#include "common.h"
+
+#define SLAB_GRAIN 16
+
+typedef struct Slab Slab;
+
+typedef struct {
+    u32 size;
+    u32 per_slab;
+    Slab *partial;
+    Slab *empty;
+    pthread_mutex_t lock;
+} SlabClass;
+
+// Packs variable-size objects into slabs of equally sized slots, one slab
+// list per SLAB_GRAIN multiple up to max_size. Slabs are aligned to their
+// size so an object finds its slab from its address. Each class keeps one
+// slab that ran empty for its next allocations, so that a population moving
+// around a slab boundary does not allocate and free a slab every time, and
+// further empty slabs go back to the system. The bytes of slabs held are kept
+// in *footprint.
+typedef struct {
+    u32 slab_size;
+    u32 num_classes;
+    SlabClass *classes;
+    u64 *footprint;
+} SlabAllocator;
+
+void sa_init(SlabAllocator *sa, u32 max_size, u64 *footprint);
+void sa_deinit(SlabAllocator *sa);
+
+void *sa_alloc(SlabAllocator *sa, u32 size);
+void sa_free(SlabAllocator *sa, void *p);
+
+// Objects of sizes with the same class can be resized in place
+u32 sa_class(u32 size);
+
+#endif // SLAB_H_
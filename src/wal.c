@@ -0,0 +1,320 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "murmur/murmur3.h"
+#include "wal.h"
+
+#define WAL_MAGIC 0x31474f4c4d534148ULL
+#define WAL_READ_SIZE (1 << 20)
+#define WAL_INITIAL_CAP 4096
+
+// The log starts with the lsn of its first record, and each record is
+// covered by a hash of everything past the hash itself
+typedef struct {
+    u64 magic;
+    u64 base_lsn;
+} WalHeader;
+
+typedef struct {
+    u32 hash;
+    u32 key_size;
+    u64 lsn;
+    u64 value;
+    u8 op;
+    char key[];
+} WalRecord;
+
+#define WAL_RECORD_HEADER offsetof(WalRecord, key)
+
+static u32 record_hash(const char *record, u64 size) {
+    u32 hash;
+    MurmurHash3_x86_32(record + sizeof(u32), size - sizeof(u32), 0, &hash);
+    return hash;
+}
+
+static void write_all(int fd, const char *data, u64 len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        ASSERT(n > 0);
+        data += n;
+        len -= n;
+    }
+}
+
+static void header_write(int fd, u64 base_lsn) {
+    WalHeader header = {WAL_MAGIC, base_lsn};
+    write_all(fd, (const char *) &header, sizeof(header));
+    ASSERT(fdatasync(fd) == 0);
+}
+
+// Makes a rename or creation within the log's directory durable
+static void dir_sync(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+    ASSERT(dir);
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    ASSERT(fd != -1);
+    ASSERT(fsync(fd) == 0);
+    close(fd);
+    free(dir);
+}
+
+// Applies records in order until the end of the file or the first one that
+// is cut short, fails its hash or breaks the lsn sequence, which is where the
+// log is truncated
+static void wal_replay(Wal *wal, u64 base_lsn, WalReplayFn replay, void *ctx) {
+    u64 cap = WAL_READ_SIZE;
+    char *buf = malloc(cap);
+    ASSERT(buf);
+
+    off_t buf_off = sizeof(WalHeader);
+    u64 len = 0;
+    u64 pos = 0;
+    bool eof = false;
+    wal->next_lsn = base_lsn;
+
+    while (true) {
+        WalRecord record;
+        u64 left = len - pos;
+        bool whole = left >= WAL_RECORD_HEADER;
+
+        if (whole) {
+            memcpy(&record, buf + pos, WAL_RECORD_HEADER);
+            whole = left >= WAL_RECORD_HEADER + record.key_size;
+        }
+
+        if (!whole && !eof) {
+            memmove(buf, buf + pos, left);
+            buf_off += pos;
+            len = left;
+            pos = 0;
+
+            if (len == cap) {
+                cap *= 2;
+                buf = realloc(buf, cap);
+                ASSERT(buf);
+            }
+
+            ssize_t n = pread(wal->fd, buf + len, cap - len, buf_off + len);
+            ASSERT(n >= 0);
+            len += n;
+            eof = n == 0;
+            continue;
+        }
+
+        if (!whole)
+            break;
+
+        u64 size = WAL_RECORD_HEADER + record.key_size;
+        if (record.hash != record_hash(buf + pos, size) ||
+            record.lsn != wal->next_lsn)
+            break;
+
+        replay(
+            record.op, buf + pos + WAL_RECORD_HEADER, record.key_size,
+            record.value, record.lsn, ctx
+        );
+        wal->next_lsn += 1;
+        pos += size;
+    }
+
+    ASSERT(ftruncate(wal->fd, buf_off + pos) == 0);
+    free(buf);
+}
+
+static void *wal_syncer(void *arg) {
+    Wal *wal = arg;
+    pthread_mutex_lock(&wal->lock);
+
+    while (!wal->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        u64 ns = deadline.tv_nsec + (u64) wal->sync_ms * 1000000;
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&wal->wake, &wal->lock, &deadline);
+
+        u64 lsn = wal->next_lsn - 1;
+        pthread_mutex_unlock(&wal->lock);
+        wal_commit(wal, lsn);
+        pthread_mutex_lock(&wal->lock);
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+void wal_open(
+    Wal *wal, const char *path, u64 first_lsn, u32 sync_ms,
+    WalReplayFn replay, void *ctx
+) {
+    wal->path = strdup(path);
+    wal->fd = open(path, O_CREAT | O_RDWR | O_APPEND, 0666);
+    ASSERT(wal->path);
+    ASSERT(wal->fd != -1);
+
+    WalHeader header;
+    ssize_t n = pread(wal->fd, &header, sizeof(header), 0);
+    if (n == 0) {
+        header = (WalHeader) {WAL_MAGIC, first_lsn};
+        header_write(wal->fd, header.base_lsn);
+        dir_sync(path);
+    }
+    else {
+        ASSERT(n == sizeof(header) && header.magic == WAL_MAGIC);
+    }
+
+    wal_replay(wal, header.base_lsn, replay, ctx);
+    wal->durable_lsn = wal->next_lsn - 1;
+    wal->sync_ms = sync_ms;
+
+    wal->buf_cap = WAL_INITIAL_CAP;
+    wal->spare_cap = WAL_INITIAL_CAP;
+    wal->buf = malloc(wal->buf_cap);
+    wal->spare = malloc(wal->spare_cap);
+    ASSERT(wal->buf);
+    ASSERT(wal->spare);
+    wal->len = 0;
+    wal->committing = false;
+    wal->records = 0;
+    wal->syncs = 0;
+
+    wal->stop = false;
+    ASSERT(pthread_mutex_init(&wal->lock, NULL) == 0);
+    ASSERT(pthread_cond_init(&wal->durable, NULL) == 0);
+    ASSERT(pthread_cond_init(&wal->wake, NULL) == 0);
+    if (sync_ms > 0)
+        ASSERT(pthread_create(&wal->syncer, NULL, wal_syncer, wal) == 0);
+}
+
+void wal_close(Wal *wal) {
+    if (wal->sync_ms > 0) {
+        pthread_mutex_lock(&wal->lock);
+        wal->stop = true;
+        pthread_cond_signal(&wal->wake);
+        pthread_mutex_unlock(&wal->lock);
+        ASSERT(pthread_join(wal->syncer, NULL) == 0);
+    }
+
+    wal_commit(wal, wal_last_lsn(wal));
+
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->durable);
+    pthread_cond_destroy(&wal->wake);
+    ASSERT(close(wal->fd) != -1);
+    free(wal->buf);
+    free(wal->spare);
+    free(wal->path);
+}
+
+u64 wal_append(
+    Wal *wal, WalOp op, const char *key, u32 key_size, u64 value
+) {
+    u64 size = WAL_RECORD_HEADER + key_size;
+    pthread_mutex_lock(&wal->lock);
+
+    if (wal->len + size > wal->buf_cap) {
+        while (wal->len + size > wal->buf_cap)
+            wal->buf_cap *= 2;
+        wal->buf = realloc(wal->buf, wal->buf_cap);
+        ASSERT(wal->buf);
+    }
+
+    WalRecord record = {0, key_size, wal->next_lsn++, value, op};
+    char *dst = wal->buf + wal->len;
+    memcpy(dst, &record, WAL_RECORD_HEADER);
+    memcpy(dst + WAL_RECORD_HEADER, key, key_size);
+    record.hash = record_hash(dst, size);
+    memcpy(dst, &record.hash, sizeof(record.hash));
+
+    wal->len += size;
+    wal->records += 1;
+    u64 lsn = record.lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+void wal_commit(Wal *wal, u64 lsn) {
+    pthread_mutex_lock(&wal->lock);
+
+    while (wal->durable_lsn < lsn) {
+        if (wal->committing) {
+            pthread_cond_wait(&wal->durable, &wal->lock);
+            continue;
+        }
+
+        // Lead a commit of everything appended so far, leaving the other
+        // buffer to the records that arrive meanwhile
+        char *batch = wal->buf;
+        u64 batch_cap = wal->buf_cap;
+        u64 len = wal->len;
+        u64 end = wal->next_lsn - 1;
+        int fd = wal->fd;
+
+        wal->buf = wal->spare;
+        wal->buf_cap = wal->spare_cap;
+        wal->spare = batch;
+        wal->spare_cap = batch_cap;
+        wal->len = 0;
+        wal->committing = true;
+        pthread_mutex_unlock(&wal->lock);
+
+        write_all(fd, batch, len);
+        ASSERT(fdatasync(fd) == 0);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->durable_lsn = end;
+        wal->committing = false;
+        wal->syncs += 1;
+        pthread_cond_broadcast(&wal->durable);
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+}
+
+u64 wal_last_lsn(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    u64 lsn = wal->next_lsn - 1;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+// Records go to a fresh file next to the log, which replaces it only once
+// they are all on disk
+void wal_rewrite_begin(Wal *wal) {
+    wal_commit(wal, wal_last_lsn(wal));
+
+    u64 path_size = strlen(wal->path) + sizeof(".tmp");
+    char *tmp = malloc(path_size);
+    ASSERT(tmp);
+    snprintf(tmp, path_size, "%s.tmp", wal->path);
+
+    int fd = open(tmp, O_CREAT | O_RDWR | O_TRUNC | O_APPEND, 0666);
+    ASSERT(fd != -1);
+    free(tmp);
+
+    pthread_mutex_lock(&wal->lock);
+    header_write(fd, wal->next_lsn);
+    ASSERT(close(wal->fd) != -1);
+    wal->fd = fd;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_rewrite_end(Wal *wal) {
+    wal_commit(wal, wal_last_lsn(wal));
+
+    u64 path_size = strlen(wal->path) + sizeof(".tmp");
+    char *tmp = malloc(path_size);
+    ASSERT(tmp);
+    snprintf(tmp, path_size, "%s.tmp", wal->path);
+
+    ASSERT(rename(tmp, wal->path) == 0);
+    dir_sync(wal->path);
+    free(tmp);
+}
@@ -0,0 +1,70 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <pthread.h>
+
+#include "common.h"
+
+typedef enum {
+    WAL_PUT = 1,
+    WAL_REMOVE = 2,
+} WalOp;
+
+// Called for every intact record of the log in order
+typedef void (*WalReplayFn)(
+    WalOp op, const char *key, u32 key_size, u64 value, u64 lsn, void *ctx
+);
+
+// Append-only log of map mutations. Records are numbered by their lsn and
+// gathered in memory until a commit writes and syncs them. Commits run by
+// one leader at a time while later records gather in the other buffer, so
+// every thread waiting meanwhile is covered by the leader's next fdatasync.
+typedef struct {
+    int fd;
+    char *path;
+    u32 sync_ms;
+    u64 next_lsn;
+    u64 durable_lsn;
+
+    char *buf;
+    u64 len;
+    u64 buf_cap;
+    char *spare;
+    u64 spare_cap;
+    bool committing;
+
+    bool stop;
+    pthread_t syncer;
+    pthread_mutex_t lock;
+    pthread_cond_t durable;
+    pthread_cond_t wake;
+
+    u64 records;
+    u64 syncs;
+} Wal;
+
+// Opens or creates the log at path and replays its records, cutting off a
+// torn tail left by a crash. A new log numbers its records from first_lsn.
+// With sync_ms > 0 a background thread commits every sync_ms and wal_commit
+// is never needed.
+void wal_open(
+    Wal *wal, const char *path, u64 first_lsn, u32 sync_ms,
+    WalReplayFn replay, void *ctx
+);
+// Commits everything appended before closing
+void wal_close(Wal *wal);
+
+// Returns the lsn of the new record
+u64 wal_append(
+    Wal *wal, WalOp op, const char *key, u32 key_size, u64 value
+);
+// Waits until every record up to lsn is on disk
+void wal_commit(Wal *wal, u64 lsn);
+u64 wal_last_lsn(Wal *wal);
+
+// Replaces the log with the records appended between these calls, which
+// must not overlap with any other use of the log
+void wal_rewrite_begin(Wal *wal);
+void wal_rewrite_end(Wal *wal);
+
+#endif // WAL_H_